@@ -50,13 +50,18 @@ struct lpage;
 void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
+void mmu_unmap_paddr(paddr_t pa);
+void mmu_unmap_as(struct addrspace *as);
+void mmu_map_zero(struct addrspace *as, vaddr_t va);
 
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
+paddr_t coremap_allocuser_zero(struct lpage *lp);
 void coremap_free(paddr_t page, bool iskern);
 
 /* physical page pinning */
 void coremap_pin(paddr_t paddr);
+bool coremap_trypin(paddr_t paddr);
 int coremap_pageispinned(paddr_t paddr);
 void coremap_unpin(paddr_t paddr);
 
@@ -84,6 +89,8 @@ void coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr);
  * Coremap functions whose existence is machine-dependent.
  */
 void coremap_bootstrap(void);
+void coremap_pageout_bootstrap(void);
+bool coremap_prezero(void);
 void coremap_print_short(void);
 void coremap_print_long(void);
 
@@ -30,6 +30,7 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <platform/maxcpus.h>	// for MAXCPUS
 
 /*
  * Machine-dependent VM system definitions.
@@ -120,11 +121,36 @@ struct cpu_vm_machdep {
 	uint32_t cvm_nexttlb;
 	/* for OPT_SEQTLB, next TLB entry to use (after TLB full) */
 	uint32_t cvm_tlbseqslot;
+
+	/* ASID loaded in the MMU (0 for none) */
+	uint32_t cvm_asid;
+	/* next ASID to hand out, and the current ASID generation */
+	uint32_t cvm_nextasid;
+	uint32_t cvm_asidgen;
 };
 
 void cpu_vm_machdep_init(struct cpu_vm_machdep *cvm);
 void cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm);
 
+/*
+ * Machine-dependent per-address-space data
+ *
+ * ASIDs are allocated per CPU, so an address space has one for each
+ * CPU it has run on. An ASID is only valid if its generation matches
+ * that CPU's cvm_asidgen; a generation of 0 is never current.
+ *
+ * am_zerocpus has a bit set for each CPU where the address space may
+ * have the shared zero frame mapped (see mmu_map_zero).
+ */
+
+struct addrspace_machdep {
+	uint8_t am_asid[MAXCPUS];
+	uint32_t am_asidgen[MAXCPUS];
+	uint32_t am_zerocpus;
+};
+
+void as_machdep_init(struct addrspace_machdep *am);
+
 /*
  * TLB shootdown bits.
  *
@@ -134,11 +160,15 @@ void cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm);
  * sometimes end up flushing out a translation other than the one
  * someone wanted gone, unless we check that the coremap index
  * matches.
+ *
+ * A negative ts_tlbix instead means "invalidate every entry tagged
+ * with ASID ts_asid"; that's how a dead address space is cleared out
+ * of other CPUs' TLBs.
  */
-
 struct tlbshootdown {
 	int ts_tlbix;
 	unsigned ts_coremapindex;
+	uint32_t ts_asid;
 };
 
 #define TLBSHOOTDOWN_MAX 16
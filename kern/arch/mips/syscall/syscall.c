@@ -37,6 +37,7 @@
 #include <syscall.h>
 #include <kern/wait.h> /* New include of wait macros for _exit */
 #include <copyinout.h> /* A4 SETUP - new include for lseek */
+#include "opt-dumbvm.h"
 /*
  * System call dispatcher.
  *
@@ -89,6 +90,9 @@ syscall(struct trapframe *tf)
 	off_t pos;
 	off_t retval64 = 0;
 	/* END A4 SETUP */
+#if !OPT_DUMBVM
+	int fd;		/* for mmap, which also uses pos */
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -200,6 +204,34 @@ syscall(struct trapframe *tf)
 		break;
 	    
 	    /* END A4 SETUP */
+
+#if !OPT_DUMBVM
+	    /* VM calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+	    case SYS_mmap:
+		    /*
+		     * Six arguments: the fd is on the user stack after
+		     * the four register slots, and the 64-bit offset
+		     * after that, aligned.
+		     */
+		err = copyin((userptr_t)(tf->tf_sp+16), &fd, sizeof(int));
+		if (err) {
+			break;
+		}
+		err = copyin((userptr_t)(tf->tf_sp+24), &pos, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			       tf->tf_a3, fd, pos, &retval);
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+#endif
  
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -38,6 +38,8 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <machine/coremap.h>
+#include "opt-dumbvm.h"
 
 ////////////////////////////////////////////////////////////
 
@@ -214,11 +216,19 @@ wait(void)
 }
 
 /*
- * Idle the processor until something happens.
+ * Idle the processor until something happens. If there are free pages
+ * to zero for later zerofill faults, do one of those instead, and
+ * return so the caller can check for runnable threads again.
  */
 void 
 cpu_idle(void)
 {
+#if !OPT_DUMBVM
+	if (coremap_prezero()) {
+		cpu_irqonoff();
+		return;
+	}
+#endif
 	wait();
         cpu_irqonoff();
 }
@@ -48,6 +48,7 @@
 #include <vnode.h>
 
 #include "opt-randpage.h"
+#include "opt-clockpage.h"
 #include "opt-randtlb.h"
 
 
@@ -62,6 +63,15 @@
  * We have one coremap_entry per page of physical RAM. This is absolute
  * overhead, so it's important to keep it small - if it's overweight
  * adding more memory won't help.
+ *
+ * Free pages are kept on buddy-system free lists, so finding a free
+ * page (or a free run for a multipage kernel allocation) doesn't
+ * involve scanning the coremap. Buddy blocks are aligned relative to
+ * the first coremap page, not in physical memory; nothing needs more
+ * alignment than a page. A page is on the free lists iff it is
+ * neither allocated nor pinned. (Freed user pages are still pinned
+ * until the caller unpins them, and a free page can be pinned briefly
+ * by someone chasing an lpage that was evicted under them.)
  */
 
 
@@ -71,6 +81,29 @@
  */
 #define CM_MIN_SLACK		8
 
+/*
+ * Pageout daemon watermarks, as fractions of RAM (with floors). The
+ * daemon is woken when fewer than the low watermark of pages are
+ * free, and evicts until the high watermark is reached.
+ */
+#define CM_PAGEOUT_LOWDIV	32
+#define CM_PAGEOUT_HIGHDIV	16
+#define CM_PAGEOUT_MINLOW	4
+
+/* Pages the pageout daemon evicts per round of TLB shootdown IPIs. */
+#define PAGEOUT_BATCH		8
+
+/* Free pages kept zeroed in advance by idle CPUs. */
+#define CM_ZEROPOOL		16
+
+
+/*
+ * Buddy free lists: orders 0 through CM_MAXORDER, so the largest free
+ * block is 2^CM_MAXORDER pages.
+ */
+#define CM_MAXORDER		10
+#define CM_NORDERS		(CM_MAXORDER+1)
+#define CM_NOENTRY		((uint32_t)-1)
 
 /*
  * Coremap entry structure.
@@ -85,9 +118,16 @@ struct coremap_entry {
 
 	unsigned cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
-		cm_allocated:1;	/* true if page in use (user or kernel) */
+		cm_allocated:1,	/* true if page in use (user or kernel) */
+		cm_freehead:1,	/* true if first page of a free block */
+		cm_order:4,	/* order of the free block, if cm_freehead */
+		cm_referenced:1; /* emulated reference bit (user pages) */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
+
+	/* free list links, valid if cm_freehead */
+	uint32_t cm_freenext;
+	uint32_t cm_freeprev;
 };
 
 #define COREMAP_TO_PADDR(i)	(((paddr_t)PAGE_SIZE)*((i)+base_coremap_page))
@@ -109,6 +149,15 @@ static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 static struct wchan *coremap_pinchan;
 static struct wchan *coremap_shootchan;
 
+/*
+ * The pageout daemon sleeps on coremap_pageoutchan. It doesn't exist
+ * until swap_bootstrap calls coremap_pageout_bootstrap; until then
+ * the watermarks are 0 and nothing tries to wake it.
+ */
+static struct wchan *coremap_pageoutchan;
+static uint32_t coremap_lowat;
+static uint32_t coremap_hiwat;
+
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
 static uint32_t num_coremap_user;	/* pages allocated to user progs */
@@ -116,15 +165,58 @@ static uint32_t num_coremap_free;	/* pages not allocated at all */
 static uint32_t base_coremap_page;
 static struct coremap_entry *coremap;
 
+/* Buddy free lists: coremap index of first block of each order. */
+static uint32_t coremap_freelist[CM_NORDERS];
+static uint32_t coremap_nfreeblocks[CM_NORDERS];
+
+/*
+ * The zero frame: a kernel page of zeros that read faults on untouched
+ * pages map read-only, in any number of address spaces at once. It's
+ * never freed or written, so unlike user pages its TLB entries aren't
+ * tracked in the coremap (see mmu_map_zero).
+ */
+static paddr_t coremap_zeroframe;
+
+/*
+ * The zero pool: free pages that idle CPUs have already zeroed (see
+ * coremap_prezero). They are off the free lists, and pinned so that
+ * nothing else picks them up, but still count as free; any allocation
+ * can have one if there's nothing else, and multipage allocations
+ * empty it back onto the free lists when they can't find a block.
+ * coremap_nzeroing counts pages that are being zeroed and will go
+ * into the pool.
+ */
+static uint32_t coremap_zeropool[CM_ZEROPOOL];
+static unsigned coremap_nzeroed;
+static unsigned coremap_nzeroing;
+
 static volatile uint32_t ct_shootdowns_sent;
 static volatile uint32_t ct_shootdowns_done;
 static volatile uint32_t ct_shootdown_interrupts;
+static volatile uint32_t ct_shootdown_ipis;
+static volatile uint32_t ct_shootdown_asids;
+static volatile uint32_t ct_pageout_wakeups;
+static volatile uint32_t ct_pageout_evictions;
+static volatile uint32_t ct_asid_switches;
+static volatile uint32_t ct_asid_flushes;
+static volatile uint32_t ct_zeromaps;
+static volatile uint32_t ct_zero_asidretires;
+static volatile uint32_t ct_prezeroed;
+static volatile uint32_t ct_zeropool_used;
+static volatile uint32_t ct_zeropool_drained;
 
 /* ASST3 - index of the last evicted coremap entry  */
-#if !OPT_RANDPAGE
+#if !OPT_RANDPAGE && !OPT_CLOCKPAGE
 	/* used by the sequential version of page_replace  */
 	static int last_evicted = -1;
 #endif
+
+#if OPT_CLOCKPAGE && !OPT_RANDPAGE
+	/* clock hand and stats for the CLOCK version of page_replace */
+	static uint32_t clock_hand;
+	static volatile uint32_t ct_clock_refclears;
+	static volatile uint32_t ct_clock_dirtyskips;
+#endif
 ////////////////////////////////////////////////////////////
 //
 // Per-CPU data
@@ -135,6 +227,9 @@ cpu_vm_machdep_init(struct cpu_vm_machdep *cvm)
 	cvm->cvm_lastas = NULL;
 	cvm->cvm_nexttlb = 0;
 	cvm->cvm_tlbseqslot = 0;
+	cvm->cvm_asid = 0;
+	cvm->cvm_nextasid = 1;
+	cvm->cvm_asidgen = 1;
 }
 
 void
@@ -144,6 +239,22 @@ cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 	/* nothing */
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-address-space data
+
+void
+as_machdep_init(struct addrspace_machdep *am)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		am->am_asid[i] = 0;
+		am->am_asidgen[i] = 0;
+	}
+	am->am_zerocpus = 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Stats
@@ -151,16 +262,49 @@ cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 void
 vm_printmdstats(void)
 {
-	uint32_t ss, sd, si;
+	uint32_t ss, sd, si, sp, sa, pw, pe, sw, af, zm, zr, pz, pu, pd;
 
 	spinlock_acquire(&coremap_spinlock);
 	ss = ct_shootdowns_sent;
 	sd = ct_shootdowns_done;
 	si = ct_shootdown_interrupts;
+	sp = ct_shootdown_ipis;
+	sa = ct_shootdown_asids;
+	pw = ct_pageout_wakeups;
+	pe = ct_pageout_evictions;
+	sw = ct_asid_switches;
+	af = ct_asid_flushes;
+	zm = ct_zeromaps;
+	zr = ct_zero_asidretires;
+	pz = ct_prezeroed;
+	pu = ct_zeropool_used;
+	pd = ct_zeropool_drained;
 	spinlock_release(&coremap_spinlock);
 
-	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
-		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	kprintf("vm: shootdowns: %lu sent in %lu IPIs, %lu done "
+		"(%lu interrupts)\n", (unsigned long) ss, (unsigned long) sp,
+		(unsigned long) sd, (unsigned long) si);
+	kprintf("vm: address space teardown ASID flushes: %lu\n",
+		(unsigned long) sa);
+	kprintf("vm: pageout daemon: %lu wakeups, %lu evictions\n",
+		(unsigned long) pw, (unsigned long) pe);
+	kprintf("vm: address space switches: %lu, TLB flushes for ASID "
+		"rollover: %lu\n", (unsigned long) sw, (unsigned long) af);
+	kprintf("vm: zero frame: %lu read mappings, %lu ASIDs retired\n",
+		(unsigned long) zm, (unsigned long) zr);
+	kprintf("vm: zero pool: %lu pages zeroed while idle, %lu used, "
+		"%lu given back\n", (unsigned long) pz, (unsigned long) pu,
+		(unsigned long) pd);
+#if OPT_RANDPAGE
+	kprintf("vm: page replacement: random\n");
+#elif OPT_CLOCKPAGE
+	kprintf("vm: page replacement: clock; %lu second chances, "
+		"%lu dirty pages passed over\n",
+		(unsigned long) ct_clock_refclears,
+		(unsigned long) ct_clock_dirtyskips);
+#else
+	kprintf("vm: page replacement: sequential\n");
+#endif
 }
 
 ////////////////////////////////////////////////////////////
@@ -206,7 +350,8 @@ tlb_invalidate(int tlbix)
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
 	tlb_read(&ehi, &elo, tlbix);
-	if (elo & TLBLO_VALID) {
+	if ((elo & TLBLO_VALID) &&
+	    (elo & TLBLO_PPAGE) != coremap_zeroframe) {
 		pa = elo & TLBLO_PPAGE;
 		cmix = PADDR_TO_COREMAP(pa);
 		KASSERT(cmix < num_coremap_entries);
@@ -219,6 +364,7 @@ tlb_invalidate(int tlbix)
 	}
 
 	tlb_write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
+	tlb_setasid(curcpu->c_vm.cvm_asid);
 	DEBUG(DB_TLB, "... pa ------- <-- tlb %d\n", tlbix);
 }
 
@@ -241,7 +387,32 @@ tlb_clear(void)
 }
 
 /*
- * Do one TLB shootdown.
+ * tlb_flushasid: invalidates every TLB entry tagged with ASID.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+tlb_flushasid(uint32_t asid)
+{
+	uint32_t elo, ehi;
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) &&
+		    (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+			tlb_invalidate(i);
+		}
+	}
+	/* tlb_read loads EntryHi */
+	tlb_setasid(curcpu->c_vm.cvm_asid);
+}
+
+/*
+ * Do a batch of TLB shootdowns.
  */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts, int num)
@@ -255,6 +426,11 @@ vm_tlbshootdown(const struct tlbshootdown *ts, int num)
 	for (i=0; i<num; i++) {
 		tlbix = ts[i].ts_tlbix;
 		where = ts[i].ts_coremapindex;
+		if (tlbix < 0) {
+			tlb_flushasid(ts[i].ts_asid);
+			ct_shootdowns_done++;
+			continue;
+		}
 		if (coremap[where].cm_tlbix == tlbix &&
 		    coremap[where].cm_cpunum == curcpu->c_number) {
 			tlb_invalidate(tlbix);
@@ -293,14 +469,123 @@ tlb_shootwait(void)
 }
 
 /*
- * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
- * it if it exists.
+ * tlb_unmap_page_start: Starts removing the TLB mapping of the page
+ * at coremap index WHERE, if it has one. If it's in this CPU's TLB
+ * it's invalidated on the spot. If it's on another CPU a shootdown is
+ * queued for that CPU, but no IPI is sent; instead the CPU's bit is
+ * set in *CPUMASK. Once the caller has queued everything it wants
+ * gone it calls tlb_shootsend to interrupt each target CPU once, and
+ * then tlb_unmap_wait on each page.
+ *
+ * The page must be pinned, so nobody can map it again (or evict it)
+ * behind our back while the shootdown is in flight.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+tlb_unmap_page_start(unsigned where, uint32_t *cpumask)
+{
+	struct tlbshootdown ts;
+	unsigned cpunum;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_pinned);
+
+	if (coremap[where].cm_tlbix < 0) {
+		return;
+	}
+
+	cpunum = coremap[where].cm_cpunum;
+	if (cpunum != curcpu->c_number) {
+		/* yay, TLB shootdown */
+		KASSERT(cpunum < MAXCPUS);
+		ts.ts_tlbix = coremap[where].cm_tlbix;
+		ts.ts_coremapindex = where;
+		ts.ts_asid = 0;
+		ct_shootdowns_sent++;
+		ipi_tlbshootdown_queue(cpunum, &ts);
+		*cpumask |= (uint32_t)1 << cpunum;
+	}
+	else {
+		tlb_invalidate(coremap[where].cm_tlbix);
+		coremap[where].cm_tlbix = -1;
+		coremap[where].cm_cpunum = 0;
+		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+		      (unsigned long) COREMAP_TO_PADDR(where));
+	}
+}
+
+/*
+ * tlb_shootsend: interrupt each CPU in CPUMASK to process the
+ * shootdowns queued for it.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+tlb_shootsend(uint32_t cpumask)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; cpumask != 0; i++, cpumask >>= 1) {
+		if (cpumask & 1) {
+			ct_shootdown_ipis++;
+			ipi_tlbshootdown_send(i);
+		}
+	}
+}
+
+/*
+ * tlb_unmap_wait: wait until the page at coremap index WHERE is in
+ * nobody's TLB, after tlb_unmap_page_start and tlb_shootsend.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May release it
+ * and sleep while waiting for a shootdown.
+ */
+static
+void
+tlb_unmap_wait(unsigned where)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_pinned);
+
+	while (coremap[where].cm_tlbix != -1) {
+		tlb_shootwait();
+	}
+	KASSERT(coremap[where].cm_cpunum == 0);
+}
+
+/*
+ * tlb_unmap_page: Removes the TLB mapping of the page at coremap
+ * index WHERE, if it has one, whichever CPU it lives on, and waits
+ * for it to be gone.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May release it
+ * and sleep while waiting for a shootdown.
+ */
+static
+void
+tlb_unmap_page(unsigned where)
+{
+	uint32_t cpumask = 0;
+
+	tlb_unmap_page_start(where, &cpumask);
+	tlb_shootsend(cpumask);
+	tlb_unmap_wait(where);
+}
+
+/*
+ * tlb_unmap: Searches the TLB for a vaddr translation in address
+ * space ASID and invalidates it if it exists.
  *
  * Synchronization: assumes we hold coremap_spinlock. Does not block. 
  */
 static
 void
-tlb_unmap(vaddr_t va)
+tlb_unmap(vaddr_t va, uint32_t asid)
 {
 	int i;
 	uint32_t elo = 0, ehi = 0;
@@ -309,8 +594,9 @@ tlb_unmap(vaddr_t va)
 
 	KASSERT(va < MIPS_KSEG0);
 
-	i = tlb_probe(va & PAGE_FRAME,0);
+	i = tlb_probe((va & PAGE_FRAME) | (asid << TLBHI_PIDSHIFT), 0);
 	if (i < 0) {
+		tlb_setasid(curcpu->c_vm.cvm_asid);
 		return;
 	}
 	
@@ -384,7 +670,88 @@ page_replace(void)
 	return evict;
 }
 
-#else /* not OPT_RANDPAGE */
+#elif OPT_CLOCKPAGE
+
+/*
+ * CLOCK (second-chance) page replacement.
+ *
+ * The MIPS has no hardware reference bits, so we emulate them:
+ * cm_referenced is set whenever a page is entered into the TLB (see
+ * mmu_map), which happens on every fault on it. When the clock hand
+ * finds a referenced page it clears the bit and knocks the page out
+ * of this CPU's TLB, so the next access to it takes a (minor) fault
+ * in lpage_fault and sets the bit again. Pages mapped in another
+ * CPU's TLB are treated as referenced; shooting them down just to
+ * sample the bit isn't worth the IPI.
+ *
+ * Unreferenced clean pages are preferred over dirty ones, since they
+ * can be discarded without writing to swap. The hand makes up to
+ * three sweeps:
+ *
+ *    1. take an unreferenced clean page; clear reference bits;
+ *    2. take an unreferenced page, clean or dirty;
+ *    3. take anything that isn't pinned or kernel.
+ *
+ * The dirty bit is read from the lpage without locking it; it's only
+ * a hint, and lpage_evict does the real check.
+ */
+
+static
+uint32_t
+page_replace(void)
+{
+	uint32_t i, n;
+	unsigned pass;
+	struct lpage *lp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (pass = 0; pass < 3; pass++) {
+		for (n = 0; n < num_coremap_entries; n++) {
+			i = clock_hand;
+			clock_hand = (clock_hand + 1) % num_coremap_entries;
+
+			if (coremap[i].cm_kernel || coremap[i].cm_pinned) {
+				continue;
+			}
+			if (!coremap[i].cm_allocated || pass == 2) {
+				goto found;
+			}
+			if (coremap[i].cm_referenced) {
+				coremap[i].cm_referenced = 0;
+				if (coremap[i].cm_tlbix >= 0 &&
+				    coremap[i].cm_cpunum == curcpu->c_number) {
+					tlb_invalidate(coremap[i].cm_tlbix);
+				}
+				ct_clock_refclears++;
+				continue;
+			}
+			if (coremap[i].cm_tlbix >= 0) {
+				/* live in another CPU's TLB */
+				continue;
+			}
+			lp = coremap[i].cm_lpage;
+			KASSERT(lp != NULL);
+			if (pass == 0 && LP_ISDIRTY(lp)) {
+				ct_clock_dirtyskips++;
+				continue;
+			}
+			goto found;
+		}
+	}
+	panic("page_replace: no evictable pages\n");
+
+ found:
+	DEBUG(DB_VM, "clock_page_replace evicting %u (pass %u) cm max %u\n",
+	      i, pass, num_coremap_entries);
+
+	KASSERT(coremap[i].cm_kernel==0);
+	KASSERT(coremap[i].cm_pinned==0);
+
+	return i;
+}
+
+#else /* not OPT_RANDPAGE, not OPT_CLOCKPAGE */
 
 /*
  * Sequential page replacement.
@@ -419,8 +786,209 @@ page_replace(void)
 	return last_evicted;
 }
 
-#endif /* OPT_RANDPAGE */
+#endif /* OPT_RANDPAGE, OPT_CLOCKPAGE */
+
+
+////////////////////////////////////////////////////////////
+//
+// Free lists
+//
+
+/*
+ * Add a free block of 2^order pages starting at coremap index IX to
+ * its free list, or take it off.
+ *
+ * Synchronization: assumes we hold coremap_spinlock (or are in boot).
+ */
+static
+void
+freelist_insert(uint32_t ix, unsigned order)
+{
+	uint32_t head;
+
+	KASSERT(order <= CM_MAXORDER);
+	KASSERT(!coremap[ix].cm_freehead);
+
+	head = coremap_freelist[order];
+	coremap[ix].cm_freehead = 1;
+	coremap[ix].cm_order = order;
+	coremap[ix].cm_freeprev = CM_NOENTRY;
+	coremap[ix].cm_freenext = head;
+	if (head != CM_NOENTRY) {
+		coremap[head].cm_freeprev = ix;
+	}
+	coremap_freelist[order] = ix;
+	coremap_nfreeblocks[order]++;
+}
+
+static
+void
+freelist_remove(uint32_t ix)
+{
+	uint32_t next, prev;
+	unsigned order;
+
+	KASSERT(coremap[ix].cm_freehead);
+
+	order = coremap[ix].cm_order;
+	next = coremap[ix].cm_freenext;
+	prev = coremap[ix].cm_freeprev;
+	if (prev != CM_NOENTRY) {
+		coremap[prev].cm_freenext = next;
+	}
+	else {
+		KASSERT(coremap_freelist[order] == ix);
+		coremap_freelist[order] = next;
+	}
+	if (next != CM_NOENTRY) {
+		coremap[next].cm_freeprev = prev;
+	}
+	coremap[ix].cm_freehead = 0;
+	coremap[ix].cm_order = 0;
+	coremap[ix].cm_freenext = coremap[ix].cm_freeprev = CM_NOENTRY;
+	KASSERT(coremap_nfreeblocks[order] > 0);
+	coremap_nfreeblocks[order]--;
+}
+
+static
+bool
+freelist_isblock(uint32_t ix, unsigned order)
+{
+	return ix < num_coremap_entries && coremap[ix].cm_freehead &&
+		coremap[ix].cm_order == order;
+}
+
+/*
+ * Put one free, unpinned page on the free lists, merging it with its
+ * buddies as far as possible.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+coremap_freepage(uint32_t ix)
+{
+	uint32_t buddy;
+	unsigned order;
+
+	KASSERT(coremap[ix].cm_allocated == 0);
+	KASSERT(coremap[ix].cm_pinned == 0);
+
+	for (order = 0; order < CM_MAXORDER; order++) {
+		buddy = ix ^ (1U << order);
+		if (!freelist_isblock(buddy, order)) {
+			break;
+		}
+		freelist_remove(buddy);
+		if (buddy < ix) {
+			ix = buddy;
+		}
+	}
+	freelist_insert(ix, order);
+}
+
+/*
+ * Take one particular free page off the free lists, splitting up the
+ * block that contains it.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+coremap_takepage(uint32_t ix)
+{
+	uint32_t base, half;
+	unsigned order;
+
+	KASSERT(coremap[ix].cm_allocated == 0);
+	KASSERT(coremap[ix].cm_pinned == 0);
+
+	for (order = 0; order <= CM_MAXORDER; order++) {
+		base = ix & ~((1U << order) - 1);
+		if (freelist_isblock(base, order)) {
+			break;
+		}
+	}
+	KASSERT(order <= CM_MAXORDER);
+
+	freelist_remove(base);
+	while (order > 0) {
+		order--;
+		half = 1U << order;
+		if (ix < base + half) {
+			freelist_insert(base + half, order);
+		}
+		else {
+			freelist_insert(base, order);
+			base += half;
+		}
+	}
+	KASSERT(base == ix);
+}
+
+/*
+ * Allocate a free block of 2^order pages, splitting a bigger block if
+ * necessary. Returns the coremap index or CM_NOENTRY. The pages are
+ * left unmarked; the caller does that.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+coremap_allocblock(unsigned order)
+{
+	uint32_t ix;
+	unsigned k;
+
+	for (k = order; k <= CM_MAXORDER; k++) {
+		if (coremap_freelist[k] != CM_NOENTRY) {
+			break;
+		}
+	}
+	if (k > CM_MAXORDER) {
+		return CM_NOENTRY;
+	}
+
+	ix = coremap_freelist[k];
+	freelist_remove(ix);
+	while (k > order) {
+		k--;
+		freelist_insert(ix + (1U << k), k);
+	}
+	return ix;
+}
+
+/*
+ * Allocate NPAGES contiguous free pages from the free lists. The
+ * buddy block is rounded up to a power of two and the unused tail is
+ * given back.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+coremap_allocrun(unsigned npages)
+{
+	uint32_t ix, i;
+	unsigned order;
+
+	order = 0;
+	while ((1U << order) < npages) {
+		order++;
+	}
+	if (order > CM_MAXORDER) {
+		return CM_NOENTRY;
+	}
 
+	ix = coremap_allocblock(order);
+	if (ix == CM_NOENTRY) {
+		return CM_NOENTRY;
+	}
+	for (i = ix + npages; i < ix + (1U << order); i++) {
+		coremap_freepage(i);
+	}
+	return ix;
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -450,6 +1018,7 @@ coremap_bootstrap(void)
 	uint32_t i;
 	paddr_t first, last;
 	uint32_t npages, coremapsize;
+	vaddr_t zeroframe;
 
 	ram_getsize(&first, &last);
 
@@ -509,10 +1078,35 @@ coremap_bootstrap(void)
 		coremap[i].cm_kernel = 0;
 		coremap[i].cm_notlast = 0;
 		coremap[i].cm_allocated = 0;
+		coremap[i].cm_freehead = 0;
+		coremap[i].cm_order = 0;
+		coremap[i].cm_referenced = 0;
 		coremap[i].cm_pinned = 0;
 		coremap[i].cm_tlbix = -1;
 		coremap[i].cm_cpunum = 0;
 		coremap[i].cm_lpage = NULL;
+		coremap[i].cm_freenext = CM_NOENTRY;
+		coremap[i].cm_freeprev = CM_NOENTRY;
+	}
+
+	/*
+	 * Put everything on the free lists, in the biggest aligned
+	 * blocks that fit.
+	 */
+	for (i=0; i < CM_NORDERS; i++) {
+		coremap_freelist[i] = CM_NOENTRY;
+		coremap_nfreeblocks[i] = 0;
+	}
+	i = 0;
+	while (i < num_coremap_entries) {
+		unsigned order = CM_MAXORDER;
+
+		while ((i & ((1U << order) - 1)) != 0 ||
+		       i + (1U << order) > num_coremap_entries) {
+			order--;
+		}
+		freelist_insert(i, order);
+		i += 1U << order;
 	}
 	//[g8buihuy] can now start using kmalloc.
 	coremap_pinchan = wchan_create("vmpin");
@@ -520,6 +1114,13 @@ coremap_bootstrap(void)
 	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
 		panic("Failed allocating coremap wchans\n");
 	}
+
+	zeroframe = alloc_kpages(1);
+	if (zeroframe == 0) {
+		panic("Failed allocating the zero frame\n");
+	}
+	bzero((char *)zeroframe, PAGE_SIZE);
+	coremap_zeroframe = KVADDR_TO_PADDR(zeroframe);
 }	
 
 ////////////////////////////////////////////////////////////
@@ -542,52 +1143,90 @@ piggish_kernel(int proposed_kernel_pages)
 	return 0;
 }
 
+/*
+ * Check if there's at least one page page_replace could pick. The
+ * replacement policies spin (or panic) if there isn't, so callers
+ * check first. Usually returns after looking at a few entries.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+bool
+coremap_have_victim(void)
+{
+	uint32_t i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<num_coremap_entries; i++) {
+		if (coremap[i].cm_allocated && !coremap[i].cm_kernel &&
+		    !coremap[i].cm_pinned) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * coremap_pinwait: wait for a pinned page to unpin.
+ */
 static
 void
-do_evict(int where)
+coremap_pinwait(void)
 {
-	struct lpage *lp;
+	wchan_lock(coremap_pinchan);
+	spinlock_release(&coremap_spinlock);
+	wchan_sleep(coremap_pinchan);
+	spinlock_acquire(&coremap_spinlock);
+}
 
+/*
+ * Eviction is done in two halves so the pageout daemon can evict
+ * several pages with one round of TLB shootdown IPIs: do_evict_start
+ * claims a victim and queues its shootdown, and do_evict_finish waits
+ * for the shootdown and writes the page out. Shootdowns for the later
+ * pages of a batch complete while the earlier ones are being written.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. do_evict_start
+ * does not block; do_evict_finish releases the spinlock to wait and
+ * to do I/O.
+ */
+static
+void
+do_evict_start(int where, uint32_t *cpumask)
+{
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
 	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_allocated);
 	KASSERT(coremap[where].cm_kernel==0);
-
-	lp = coremap[where].cm_lpage;
-	KASSERT(lp != NULL);
+	KASSERT(coremap[where].cm_lpage != NULL);
 
 	/*
 	 * Pin it now, so it doesn't get e.g. paged out by someone
-	 * else while we're waiting for TLB shootdown.
+	 * else while we're waiting for TLB shootdown. This is also
+	 * what keeps other evictions (which may run concurrently with
+	 * this one, on other pages) from choosing it.
 	 */
 	coremap[where].cm_pinned = 1;
 
-	if (coremap[where].cm_tlbix >= 0) {
-		if (coremap[where].cm_cpunum != curcpu->c_number) {
-			/* yay, TLB shootdown */
-			struct tlbshootdown ts;
-			ts.ts_tlbix = coremap[where].cm_tlbix;
-			ts.ts_coremapindex = where;
-			ct_shootdowns_sent++;
-			ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
-			while (coremap[where].cm_tlbix != -1) {
-				tlb_shootwait();
-			}
-			KASSERT(coremap[where].cm_tlbix == -1);
-			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
-		}
-		else {
-			tlb_invalidate(coremap[where].cm_tlbix);
-			coremap[where].cm_tlbix = -1;
-			coremap[where].cm_cpunum = 0;
-		}
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-		      (unsigned long) COREMAP_TO_PADDR(where));
-	}
+	tlb_unmap_page_start(where, cpumask);
+}
+
+static
+void
+do_evict_finish(int where)
+{
+	struct lpage *lp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	lp = coremap[where].cm_lpage;
+	KASSERT(lp != NULL);
+
+	tlb_unmap_wait(where);
+	KASSERT(coremap[where].cm_lpage == lp);
 
 	/* properly we ought to lock the lpage to test this */
 	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
@@ -606,7 +1245,9 @@ do_evict(int where)
 
 	coremap[where].cm_allocated = 0;
 	coremap[where].cm_lpage = NULL;
+	coremap[where].cm_referenced = 0;
 	coremap[where].cm_pinned = 0;
+	coremap_freepage(where);
 
 	num_coremap_user--;
 	num_coremap_free++;
@@ -616,6 +1257,17 @@ do_evict(int where)
 	wchan_wakeall(coremap_pinchan);
 }
 
+static
+void
+do_evict(int where)
+{
+	uint32_t cpumask = 0;
+
+	do_evict_start(where, &cpumask);
+	tlb_shootsend(cpumask);
+	do_evict_finish(where);
+}
+
 static
 int
 do_page_replace(void)
@@ -623,7 +1275,6 @@ do_page_replace(void)
 	int where;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
 	where = page_replace();
 
@@ -636,9 +1287,138 @@ do_page_replace(void)
 		do_evict(where);
 	}
 
+	/* it's free now; claim it */
+	coremap_takepage(where);
+
 	return where;
 }
 
+/*
+ * Wake the pageout daemon if free memory is below the low watermark.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+pageout_check(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (num_coremap_free < coremap_lowat && coremap_pageoutchan != NULL) {
+		wchan_wakeall(coremap_pageoutchan);
+	}
+}
+
+/*
+ * The pageout daemon. Sleeps until free memory falls below the low
+ * watermark, then evicts pages (writing back dirty ones) until it
+ * reaches the high watermark, so that faulting threads normally find
+ * a free page without having to wait for a pageout themselves.
+ *
+ * Victims are taken PAGEOUT_BATCH at a time, so that their TLB
+ * shootdowns go out together with at most one IPI per CPU.
+ *
+ * The coremap spinlock is dropped during each eviction's I/O (see
+ * do_evict_finish), so faulting threads get in between evictions and
+ * can evict other pages themselves at the same time.
+ */
+static
+void
+pageout_thread(void *data1, unsigned long data2)
+{
+	uint32_t victims[PAGEOUT_BATCH];
+	uint32_t where, cpumask;
+	unsigned i, nvictims, tries;
+
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&coremap_spinlock);
+	while (1) {
+		while (num_coremap_free >= coremap_lowat) {
+			wchan_lock(coremap_pageoutchan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(coremap_pageoutchan);
+			spinlock_acquire(&coremap_spinlock);
+		}
+		ct_pageout_wakeups++;
+
+		while (num_coremap_free < coremap_hiwat &&
+		       coremap_have_victim()) {
+			nvictims = 0;
+			cpumask = 0;
+			for (tries = 0; tries < 2*PAGEOUT_BATCH &&
+				     nvictims < PAGEOUT_BATCH &&
+				     num_coremap_free + nvictims < coremap_hiwat &&
+				     coremap_have_victim();
+			     tries++) {
+				where = page_replace();
+				if (coremap[where].cm_allocated) {
+					do_evict_start(where, &cpumask);
+					victims[nvictims++] = where;
+				}
+			}
+			tlb_shootsend(cpumask);
+			for (i=0; i<nvictims; i++) {
+				do_evict_finish(victims[i]);
+				ct_pageout_evictions++;
+			}
+		}
+
+		if (num_coremap_free < coremap_hiwat) {
+			/*
+			 * Nothing we can evict right now; everything
+			 * is kernel memory or pinned. Wait for the
+			 * next wakeup.
+			 */
+			wchan_lock(coremap_pageoutchan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(coremap_pageoutchan);
+			spinlock_acquire(&coremap_spinlock);
+		}
+	}
+}
+
+/*
+ * coremap_pageout_bootstrap: set the watermarks and start the pageout
+ * daemon. Called from swap_bootstrap, once there is somewhere to page
+ * out to.
+ */
+void
+coremap_pageout_bootstrap(void)
+{
+	struct wchan *wc;
+	uint32_t lowat, hiwat;
+	int result;
+
+	lowat = num_coremap_entries / CM_PAGEOUT_LOWDIV;
+	if (lowat < CM_PAGEOUT_MINLOW) {
+		lowat = CM_PAGEOUT_MINLOW;
+	}
+	hiwat = num_coremap_entries / CM_PAGEOUT_HIGHDIV;
+	if (hiwat < 2*lowat) {
+		hiwat = 2*lowat;
+	}
+
+	wc = wchan_create("pageout");
+	if (wc == NULL) {
+		panic("Failed allocating pageout wchan\n");
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	coremap_lowat = lowat;
+	coremap_hiwat = hiwat;
+	coremap_pageoutchan = wc;
+	spinlock_release(&coremap_spinlock);
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("Failed starting pageout daemon: %s\n",
+		      strerror(result));
+	}
+	kprintf("vm: pageout daemon: low %u, high %u pages\n", lowat, hiwat);
+}
+
 static
 void
 mark_pages_allocated(int start, int npages, int dopin, int iskern)
@@ -653,6 +1433,7 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 		KASSERT(coremap[i].cm_lpage==NULL);
 		KASSERT(coremap[i].cm_tlbix<0);
 		KASSERT(coremap[i].cm_cpunum == 0);
+		KASSERT(coremap[i].cm_freehead == 0);
 
 		if (dopin) {
 			coremap[i].cm_pinned = 1;
@@ -661,20 +1442,106 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 		if (iskern) {
 			coremap[i].cm_kernel = 1;
 		}
+		else {
+			/* about to be mapped; don't evict right away */
+			coremap[i].cm_referenced = 1;
+		}
+
+		if (i < start+npages-1) {
+			coremap[i].cm_notlast = 1;
+		}
+	}
+	if (iskern) {
+		num_coremap_kernel += npages;
+	}
+	else {
+		num_coremap_user += npages;
+	}
+	num_coremap_free -= npages;
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+}
+
+/*
+ * Take a page out of the zero pool. It's still free, as far as the
+ * counts go, and no longer pinned.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+coremap_zeropool_take(void)
+{
+	uint32_t ix;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap_nzeroed > 0);
+
+	ix = coremap_zeropool[--coremap_nzeroed];
+	KASSERT(coremap[ix].cm_pinned);
+	KASSERT(!coremap[ix].cm_allocated);
+	coremap[ix].cm_pinned = 0;
+	ct_zeropool_used++;
+
+	/* anyone waiting on the pin can look at it again */
+	wchan_wakeall(coremap_pinchan);
+	return ix;
+}
+
+/*
+ * If page IX is in the zero pool, take it out, leaving it pinned and
+ * off the free lists, and return true. This is for coremap_pin, which
+ * may be after a page that was freed under it and then zeroed.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+bool
+coremap_zeropool_remove(uint32_t ix)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<coremap_nzeroed; i++) {
+		if (coremap_zeropool[i] == ix) {
+			KASSERT(coremap[ix].cm_pinned);
+			KASSERT(!coremap[ix].cm_allocated);
+			coremap_zeropool[i] = coremap_zeropool[--coremap_nzeroed];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Put everything in the zero pool back on the free lists, where its
+ * pages can merge with their buddies again. Returns true if there was
+ * anything to put back.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+bool
+coremap_zeropool_drain(void)
+{
+	uint32_t ix;
 
-		if (i < start+npages-1) {
-			coremap[i].cm_notlast = 1;
-		}
-	}
-	if (iskern) {
-		num_coremap_kernel += npages;
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (coremap_nzeroed == 0) {
+		return false;
 	}
-	else {
-		num_coremap_user += npages;
+	while (coremap_nzeroed > 0) {
+		ix = coremap_zeropool[--coremap_nzeroed];
+		KASSERT(coremap[ix].cm_pinned);
+		KASSERT(!coremap[ix].cm_allocated);
+		coremap[ix].cm_pinned = 0;
+		coremap_freepage(ix);
+		ct_zeropool_drained++;
 	}
-	num_coremap_free -= npages;
-	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+	wchan_wakeall(coremap_pinchan);
+	return true;
 }
 
 /*
@@ -683,23 +1550,22 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
  * Allocate one page of memory, mark it pinned if requested, and
  * return its paddr. The page is marked a kernel page iff the lp
  * argument is NULL.
+ *
+ * If ZEROED isn't NULL the caller wants a zeroed page, so we try the
+ * zero pool first, and set *ZEROED if the page came from there.
+ * Otherwise the pool is only used when there are no other free pages.
  */
 static
 paddr_t
-coremap_alloc_one_page(struct lpage *lp, int dopin)
+coremap_alloc_one_page(struct lpage *lp, int dopin, bool *zeroed)
 {
-	int candidate, i, iskern;
+	int candidate, iskern;
+	bool canevict, fromzeropool;
+	uint32_t ix;
 
 	iskern = (lp == NULL);
-
-	/*
-	 * Hold this while allocating to reduce starvation of multipage
-	 * allocations. (But we can't if we're in an interrupt, or if
-	 * we're still very early in boot.)
-	 */
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
+	canevict = (curthread != NULL && !curthread->t_in_interrupt);
+	fromzeropool = false;
 
 	spinlock_acquire(&coremap_spinlock);
 
@@ -709,60 +1575,70 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	if (iskern && piggish_kernel(1)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting 1 page\n");
 		return INVALID_PADDR;
 	}
 
 	/*
-	 * For single-page allocations, start at the top end of memory. We
-	 * will do multi-page allocations at the bottom end in the hope of
-	 * reducing long-term fragmentation. But it probably won't help
-	 * much if the system gets busy.
+	 * Take a page off the free lists. The buddy allocator splits
+	 * the smallest block it can, which keeps big blocks intact for
+	 * multipage allocations as long as possible.
 	 */
 
 	candidate = -1;
 
-	if (num_coremap_free > 0) {
-		/* There's a free page. Find it. */
+	if (zeroed != NULL && coremap_nzeroed > 0) {
+		candidate = coremap_zeropool_take();
+		fromzeropool = true;
+	}
 
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			KASSERT(coremap[i].cm_kernel==0);
-			KASSERT(coremap[i].cm_lpage==NULL);
-			candidate = i;
+	while (candidate < 0) {
+		ix = coremap_allocblock(0);
+		if (ix != CM_NOENTRY) {
+			KASSERT(coremap[ix].cm_kernel==0);
+			KASSERT(coremap[ix].cm_lpage==NULL);
+			candidate = ix;
 			break;
 		}
-	}
-
-	if (candidate < 0 && curthread != NULL && !curthread->t_in_interrupt) {
-		KASSERT(num_coremap_free==0);
-		candidate = do_page_replace();
+		if (coremap_nzeroed > 0) {
+			candidate = coremap_zeropool_take();
+			fromzeropool = true;
+			break;
+		}
+		if (!canevict) {
+			break;
+		}
+		if (coremap_have_victim()) {
+			candidate = do_page_replace();
+			break;
+		}
+		/*
+		 * Every user page is pinned, presumably by other
+		 * threads' evictions and pageins in progress. Wait
+		 * for one to finish.
+		 */
+		coremap_pinwait();
 	}
 
 	if (candidate < 0) {
 		spinlock_release(&coremap_spinlock);
-		/* we don't hold global_paging_lock; don't unlock it */
 		return INVALID_PADDR;
 	}
 
 	/* At this point we should have an ok page. */
 	mark_pages_allocated(candidate, 1 /* npages */, dopin, iskern);
 	coremap[candidate].cm_lpage = lp;
+	pageout_check();
 
 	// free pages should not be in the TLB
 	KASSERT(coremap[candidate].cm_tlbix < 0);
 	KASSERT(coremap[candidate].cm_cpunum == 0);
 
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
 
+	if (zeroed != NULL) {
+		*zeroed = fromzeropool;
+	}
 	return COREMAP_TO_PADDR(candidate);
 }
 
@@ -772,35 +1648,42 @@ coremap_alloc_multipages(unsigned npages)
 {
 	int base, bestbase;
 	int badness, bestbadness;
-	int evicted;
+	int retry;
+	bool canevict;
 	unsigned i;
+	uint32_t ix;
 
 	KASSERT(npages>1);
 
-	/*
-	 * Get this early and hold it during the allocation so nobody else
-	 * can start paging while we're trying to page out the victims in
-	 * the allocation range.
-	 */
-
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
+	canevict = (curthread != NULL && !curthread->t_in_interrupt);
 
 	spinlock_acquire(&coremap_spinlock);
 
 	if (piggish_kernel(npages)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting %u pages\n",
 			npages);
 		return INVALID_PADDR;
 	}
 
 	/*
+	 * If there's a big enough free block, that's all we need. If
+	 * not, the pages in the zero pool may be what's splitting one
+	 * up; give them back and look again. (They'd be in the way of
+	 * the search below anyway, being pinned.)
+	 */
+	ix = coremap_allocrun(npages);
+	if (ix == CM_NOENTRY && coremap_zeropool_drain()) {
+		ix = coremap_allocrun(npages);
+	}
+	if (ix != CM_NOENTRY) {
+		bestbase = ix;
+		goto gotpages;
+	}
+
+	/*
+	 * Otherwise we have to make room by paging out.
 	 * Look for the best block of this length.
 	 * "badness" counts how many evictions we need to do.
 	 * Find the block where it's smallest.
@@ -852,51 +1735,66 @@ coremap_alloc_multipages(unsigned npages)
 		if (bestbase < 0) {
 			/* no good */
 			spinlock_release(&coremap_spinlock);
-			if (curthread != NULL && !curthread->t_in_interrupt) {
-				lock_release(global_paging_lock);
-			}
 			return INVALID_PADDR;
 		}
 
 		/*
-		 * If any pages need evicting, evict them and try the
-		 * whole schmear again. Because we are holding
-		 * global_paging_lock, nobody else *ought* to allocate
-		 * or pin these pages until we're done. But the
-		 * contract with global_paging_lock is that it's
-		 * advisory -- so tolerate and retry if/in case
-		 * something changes while we're paging.
+		 * Claim the pages in the range one at a time, evicting
+		 * them if necessary. Each page we claim is taken off
+		 * the free lists and left pinned, so nobody else can
+		 * allocate it while we're paging out the rest. (Other
+		 * threads can be allocating and evicting at the same
+		 * time.) If we run into a page someone else has pinned
+		 * or given to the kernel meanwhile, give back what we
+		 * claimed and try the whole schmear again.
 		 */
 
-		evicted = 0;
+		retry = 0;
 		for (i=bestbase; i<bestbase+npages; i++) {
 			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
 				/* Whoops... retry */
-				KASSERT(evicted==1);
+				KASSERT(i > (unsigned)bestbase);
+				retry = 1;
 				break;
 			}
 			if (coremap[i].cm_allocated) {
-				if (curthread == NULL ||
-				    curthread->t_in_interrupt) {
+				if (!canevict) {
 					/* Can't evict here */
-					spinlock_release(&coremap_spinlock);
-					/* don't need to unlock */
-					return INVALID_PADDR;
+					break;
 				}
 				do_evict(i);
-				evicted = 1;
+			}
+			coremap_takepage(i);
+			coremap[i].cm_pinned = 1;
+		}
+
+		if (i < bestbase+npages) {
+			/* didn't get them all; give back what we have */
+			while (i > (unsigned)bestbase) {
+				i--;
+				coremap[i].cm_pinned = 0;
+				coremap_freepage(i);
+			}
+			wchan_wakeall(coremap_pinchan);
+			if (!retry) {
+				spinlock_release(&coremap_spinlock);
+				return INVALID_PADDR;
 			}
 		}
-	} while (evicted);
+	} while (retry);
+
+	/* We have the whole range; unpin so it can be marked allocated. */
+	for (i=bestbase; i<bestbase+npages; i++) {
+		coremap[i].cm_pinned = 0;
+	}
 
+ gotpages:
 	mark_pages_allocated(bestbase, npages, 
 			     0 /* dopin -- not needed for kernel pages */,
 			     1 /* kernel */);
+	pageout_check();
 				     
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
 	return COREMAP_TO_PADDR(bestbase);
 }
 
@@ -913,7 +1811,85 @@ paddr_t
 coremap_allocuser(struct lpage *lp)
 {
 	KASSERT(!curthread->t_in_interrupt);
-	return coremap_alloc_one_page(lp, 1 /* dopin */);
+	return coremap_alloc_one_page(lp, 1 /* dopin */, NULL);
+}
+
+/*
+ * coremap_allocuser_zero
+ *
+ * Like coremap_allocuser, but the page comes back zeroed. It's taken
+ * from the zero pool if there's anything there, and zeroed here if
+ * not.
+ *
+ * Synchronization: takes coremap_spinlock.
+ * May block to swap pages out.
+ */
+paddr_t
+coremap_allocuser_zero(struct lpage *lp)
+{
+	paddr_t pa;
+	bool zeroed;
+
+	KASSERT(!curthread->t_in_interrupt);
+	pa = coremap_alloc_one_page(lp, 1 /* dopin */, &zeroed);
+	if (pa != INVALID_PADDR && !zeroed) {
+		coremap_zero_page(pa);
+	}
+	return pa;
+}
+
+/*
+ * coremap_prezero
+ *
+ * Zero one free page and put it in the zero pool, if the pool isn't
+ * full and memory isn't short. Called by idle CPUs, so that zerofill
+ * faults usually find a page ready. Returns true if it did anything,
+ * so the caller can look for other work before idling.
+ *
+ * Synchronization: takes coremap_spinlock, but not while zeroing;
+ * meanwhile the page is off the free lists and pinned, so nothing
+ * else touches it. Does not block.
+ */
+bool
+coremap_prezero(void)
+{
+	uint32_t ix;
+
+	if (coremap == NULL) {
+		/* too early */
+		return false;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	if (coremap_nzeroed + coremap_nzeroing >= CM_ZEROPOOL ||
+	    num_coremap_free <= coremap_lowat + coremap_nzeroed +
+	    coremap_nzeroing) {
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+	ix = coremap_allocblock(0);
+	if (ix == CM_NOENTRY) {
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+	KASSERT(!coremap[ix].cm_allocated);
+	coremap[ix].cm_pinned = 1;
+	coremap_nzeroing++;
+	spinlock_release(&coremap_spinlock);
+
+	bzero((char *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(ix)), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(coremap_nzeroing > 0);
+	coremap_nzeroing--;
+	KASSERT(coremap_nzeroed < CM_ZEROPOOL);
+	coremap_zeropool[coremap_nzeroed++] = ix;
+	ct_prezeroed++;
+	/* coremap_pin may be waiting for it; it can take it from the pool */
+	wchan_wakeall(coremap_pinchan);
+	spinlock_release(&coremap_spinlock);
+
+	return true;
 }
 
 /*
@@ -923,7 +1899,10 @@ coremap_allocuser(struct lpage *lp)
  * the same block. Cross-checks the iskern flag against the flags
  * maintained in the coremap entry.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes coremap_spinlock. Does not block, except
+ * to shoot down a user page that is still mapped on another CPU.
+ * (Because lpages are shared copy-on-write, the last reference to a
+ * page is not necessarily dropped where the page was last used.)
  */
 void
 coremap_free(paddr_t page, bool iskern)
@@ -951,15 +1930,9 @@ coremap_free(paddr_t page, bool iskern)
 
 		/* flush any live mapping */
 		if (coremap[i].cm_tlbix >= 0) {
-			/* should only release one's own pages */
-			KASSERT(coremap[i].cm_cpunum == curcpu->c_number);
-
-			tlb_invalidate(coremap[i].cm_tlbix);
-			coremap[i].cm_tlbix = -1;
-			coremap[i].cm_cpunum = 0;
-
-			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-				(unsigned long) COREMAP_TO_PADDR(i));
+			/* kernel pages are never in the TLB */
+			KASSERT(!coremap[i].cm_kernel);
+			tlb_unmap_page(i);
 		}
 
 		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
@@ -982,6 +1955,12 @@ coremap_free(paddr_t page, bool iskern)
 		num_coremap_free++;
 
 		coremap[i].cm_lpage = NULL;
+		coremap[i].cm_referenced = 0;
+
+		/* user pages go on the free list when they're unpinned */
+		if (!coremap[i].cm_pinned) {
+			coremap_freepage(i);
+		}
 
 		if (!coremap[i].cm_notlast) {
 			break;
@@ -1010,7 +1989,7 @@ alloc_kpages(int npages)
 		pa = coremap_alloc_multipages(npages);
 	}
 	else {
-		pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
+		pa = coremap_alloc_one_page(NULL, 0 /* dopin */, NULL);
 	}
 	if (pa==INVALID_PADDR) {
 		return 0;
@@ -1032,6 +2011,36 @@ free_kpages(vaddr_t addr)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * coremap_print_frag: print the free block counts by order and a
+ * fragmentation figure: the percentage of free pages that are not in
+ * the largest free block. (0% means all free memory is one block.)
+ *
+ * synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+coremap_print_frag(void)
+{
+	uint32_t freepages, largest;
+	unsigned order;
+
+	freepages = 0;
+	largest = 0;
+	kprintf("Free blocks by order:");
+	for (order = 0; order < CM_NORDERS; order++) {
+		kprintf(" %u", coremap_nfreeblocks[order]);
+		freepages += coremap_nfreeblocks[order] << order;
+		if (coremap_nfreeblocks[order] > 0) {
+			largest = 1U << order;
+		}
+	}
+	kprintf("\n");
+	kprintf("Largest free block %u pages of %u; fragmentation %u%%\n",
+		largest, freepages,
+		freepages == 0 ? 0 : 100 - (100 * largest) / freepages);
+}
+
 /*
  * coremap_print_short: diagnostic dump of coremap to console.
  *
@@ -1049,6 +2058,7 @@ coremap_print_short(void)
 	kprintf("Coremap: %u entries, %uk/%uu/%uf\n",
 		num_coremap_entries,
 		num_coremap_kernel, num_coremap_user, num_coremap_free);
+	coremap_print_frag();
 
 	for (i=0; i<num_coremap_entries; i++) {
 		if (atbol) {
@@ -1081,22 +2091,15 @@ coremap_print_short(void)
 }
 #undef NCOLS
 
-/*
- * coremap_pinwait: wait for a pinned page to unpin.
- */
-static
-void
-coremap_pinwait(void)
-{
-	wchan_lock(coremap_pinchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_pinchan);
-	spinlock_acquire(&coremap_spinlock);
-}
-
 /*
  * coremap_pin: mark page pinned for manipulation of contents.
  *
+ * The caller may have a stale address for a page that has been freed
+ * and then put in the zero pool, where it stays pinned indefinitely.
+ * Rather than wait for it, take it back out of the pool, as we do
+ * with a page that's merely been freed; the caller will see that it's
+ * no longer theirs and unpin it.
+ *
  * Synchronization: takes coremap_spinlock. Blocks if page is already pinned.
  */
 void
@@ -1109,12 +2112,46 @@ coremap_pin(paddr_t paddr)
 
 	spinlock_acquire(&coremap_spinlock);
 	while (coremap[ix].cm_pinned) {
+		if (!coremap[ix].cm_allocated && coremap_zeropool_remove(ix)) {
+			/* already pinned and off the free lists */
+			spinlock_release(&coremap_spinlock);
+			return;
+		}
 		coremap_pinwait();
 	}
+	if (!coremap[ix].cm_allocated) {
+		/* page was freed under us; keep it from being reused */
+		coremap_takepage(ix);
+	}
 	coremap[ix].cm_pinned = 1;
 	spinlock_release(&coremap_spinlock);
 }
 
+/*
+ * coremap_trypin: pin a user page if it's allocated and not already
+ * pinned. Returns false, without waiting, if it isn't.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+bool
+coremap_trypin(paddr_t paddr)
+{
+	unsigned ix;
+	bool ret;
+
+	ix = PADDR_TO_COREMAP(paddr);
+	KASSERT(ix<num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	ret = coremap[ix].cm_allocated && !coremap[ix].cm_kernel &&
+		!coremap[ix].cm_pinned;
+	if (ret) {
+		coremap[ix].cm_pinned = 1;
+	}
+	spinlock_release(&coremap_spinlock);
+	return ret;
+}
+
 /*
  * coremap_pageispinned: checks if page is marked pinned.
  *
@@ -1154,6 +2191,9 @@ coremap_unpin(paddr_t paddr)
 	spinlock_acquire(&coremap_spinlock);
 	KASSERT(coremap[ix].cm_pinned);
 	coremap[ix].cm_pinned = 0;
+	if (!coremap[ix].cm_allocated) {
+		coremap_freepage(ix);
+	}
 	wchan_wakeall(coremap_pinchan);
 	spinlock_release(&coremap_spinlock);
 }
@@ -1202,34 +2242,253 @@ coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr)
  * Hardware page-table interface
  */
 
+/*
+ * as_getasid: return the ASID address space AS has on this CPU, or 0
+ * if it doesn't currently have one.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+as_getasid(struct addrspace *as)
+{
+	struct addrspace_machdep *am = &as->as_machdep;
+	struct cpu_vm_machdep *cvm = &curcpu->c_vm;
+	unsigned cpunum = curcpu->c_number;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(cpunum < MAXCPUS);
+
+	if (am->am_asidgen[cpunum] != cvm->cvm_asidgen) {
+		return 0;
+	}
+	return am->am_asid[cpunum];
+}
+
+/*
+ * as_newasid: give address space AS a fresh ASID on this CPU. When
+ * we run out we start a new generation, which invalidates every ASID
+ * previously handed out on this CPU, and flush the TLB.
+ *
+ * The TLB entries of an address space that loses its ASID this way
+ * don't need to be hunted down individually: every TLB entry is
+ * tracked by its physical page, and is removed when that page is
+ * freed, evicted, or shared copy-on-write. An address space that goes
+ * away has its entries flushed by ASID first (see mmu_unmap_as), so
+ * that freeing its pages doesn't mean one shootdown per page.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+as_newasid(struct addrspace *as)
+{
+	struct addrspace_machdep *am = &as->as_machdep;
+	struct cpu_vm_machdep *cvm = &curcpu->c_vm;
+	unsigned cpunum = curcpu->c_number;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (cvm->cvm_nextasid >= NUM_ASID) {
+		cvm->cvm_asidgen++;
+		if (cvm->cvm_asidgen == 0) {
+			/* 0 means "never"; skip it */
+			cvm->cvm_asidgen = 1;
+		}
+		cvm->cvm_nextasid = 1;
+		tlb_clear();
+		ct_asid_flushes++;
+	}
+
+	am->am_asid[cpunum] = cvm->cvm_nextasid++;
+	am->am_asidgen[cpunum] = cvm->cvm_asidgen;
+	return am->am_asid[cpunum];
+}
+
 /*
  * mmu_setas: Set current address space in MMU.
  *
+ * Rather than flushing the TLB on every address space change, each
+ * address space gets a per-CPU ASID that tags its TLB entries, so
+ * switching just means loading a different ASID. ASID 0 is used when
+ * there's no address space and is never given to one.
+ *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
 void
 mmu_setas(struct addrspace *as)
 {
+	uint32_t asid;
+
 	spinlock_acquire(&coremap_spinlock);
 	if (as != curcpu->c_vm.cvm_lastas) {
 		curcpu->c_vm.cvm_lastas = as;
-		tlb_clear();
+		ct_asid_switches++;
+	}
+	if (as == NULL) {
+		asid = 0;
 	}
+	else {
+		asid = as_getasid(as);
+		if (asid == 0) {
+			asid = as_newasid(as);
+		}
+	}
+	KASSERT(asid < NUM_ASID);
+	curcpu->c_vm.cvm_asid = asid;
+	tlb_setasid(asid);
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
  * mmu_unmap: Remove a translation from the MMU.
  *
+ * Only this CPU's TLB is searched. If the address space has entries
+ * on other CPUs, they belong to pages whose own teardown will shoot
+ * them down (see as_newasid) - except for mappings of the zero frame,
+ * which aren't tracked. If the address space may have those on other
+ * CPUs, its ASIDs there are retired instead, which kills all its
+ * mappings on those CPUs at once without having to interrupt them.
+ * It gets new ASIDs the next time it runs there.
+ *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
 void
 mmu_unmap(struct addrspace *as, vaddr_t va)
 {
+	struct addrspace_machdep *am = &as->as_machdep;
+	uint32_t asid, mybit;
+	unsigned i;
+
+	spinlock_acquire(&coremap_spinlock);
+	asid = as_getasid(as);
+	if (asid != 0) {
+		tlb_unmap(va, asid);
+	}
+
+	mybit = (uint32_t)1 << curcpu->c_number;
+	if ((am->am_zerocpus & ~mybit) != 0) {
+		for (i=0; i<MAXCPUS; i++) {
+			if (i != curcpu->c_number &&
+			    (am->am_zerocpus & ((uint32_t)1 << i))) {
+				am->am_asidgen[i] = 0;
+				ct_zero_asidretires++;
+			}
+		}
+		am->am_zerocpus &= mybit;
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_map_zero: Map the zero frame read-only at VA. This is for read
+ * faults on pages that have never been touched; the first write fault
+ * gets a real page, and must mmu_unmap this mapping first.
+ *
+ * The zero frame may be mapped at any number of addresses, and isn't
+ * pinned or tracked in the coremap. Instead we note which CPUs the
+ * address space has it mapped on (see mmu_unmap).
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void
+mmu_map_zero(struct addrspace *as, vaddr_t va)
+{
+	uint32_t ehi, elo;
+	int tlbix;
+
+	spinlock_acquire(&coremap_spinlock);
+
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+	KASSERT(curcpu->c_vm.cvm_asid != 0);
+
+	ehi = (va & TLBHI_VPAGE) | (curcpu->c_vm.cvm_asid << TLBHI_PIDSHIFT);
+	elo = (coremap_zeroframe & TLBLO_PPAGE) | TLBLO_VALID;
+
+	tlbix = tlb_probe(ehi, 0);
+	if (tlbix >= 0) {
+		tlb_invalidate(tlbix);
+	}
+	else {
+		tlbix = mipstlb_getslot();
+	}
+	KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+	tlb_write(ehi, elo, tlbix);
+
+	as->as_machdep.am_zerocpus |= (uint32_t)1 << curcpu->c_number;
+	ct_zeromaps++;
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_unmap_as: Remove all translations of an address space that is
+ * being destroyed, on every CPU it has run on. Other CPUs get one
+ * queued ASID flush and one IPI each; we don't wait for them. Any
+ * entry still live when its page is freed is shot down then, by
+ * coremap_free, but usually the flush has got there first.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void
+mmu_unmap_as(struct addrspace *as)
+{
+	struct addrspace_machdep *am = &as->as_machdep;
+	struct tlbshootdown ts;
+	uint32_t asid, cpumask;
+	unsigned i;
+
 	spinlock_acquire(&coremap_spinlock);
-	if (as == curcpu->c_vm.cvm_lastas) {
-		tlb_unmap(va);
+
+	KASSERT(as != curcpu->c_vm.cvm_lastas);
+
+	asid = as_getasid(as);
+	if (asid != 0) {
+		tlb_flushasid(asid);
+	}
+
+	/*
+	 * The other CPUs' generations might have moved on, in which
+	 * case this may flush some other address space's entries.
+	 * That's harmless, and cheaper than asking.
+	 */
+	cpumask = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		if (i == curcpu->c_number || am->am_asidgen[i] == 0) {
+			continue;
+		}
+		ts.ts_tlbix = -1;
+		ts.ts_coremapindex = 0;
+		ts.ts_asid = am->am_asid[i];
+		ct_shootdowns_sent++;
+		ct_shootdown_asids++;
+		ipi_tlbshootdown_queue(i, &ts);
+		cpumask |= (uint32_t)1 << i;
+		am->am_asidgen[i] = 0;
 	}
+	am->am_asidgen[curcpu->c_number] = 0;
+	tlb_shootsend(cpumask);
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_unmap_paddr: Remove whatever translation exists for a physical
+ * page, in any address space and on any CPU. Used when a page becomes
+ * shared copy-on-write or stops being so. The page must be pinned.
+ *
+ * Synchronization: takes coremap_spinlock. May block for TLB shootdown.
+ */
+void
+mmu_unmap_paddr(paddr_t pa)
+{
+	unsigned cmix;
+
+	cmix = PADDR_TO_COREMAP(pa);
+	KASSERT(cmix < num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	tlb_unmap_page(cmix);
 	spinlock_release(&coremap_spinlock);
 }
 
@@ -1237,7 +2496,13 @@ mmu_unmap(struct addrspace *as, vaddr_t va)
  * mmu_map: Enter a translation into the MMU. (This is the end result
  * of fault handling.)
  *
- * Synchronization: Takes coremap_spinlock. Does not block.
+ * A physical page is only ever in one TLB slot at a time. A page that
+ * is shared copy-on-write may already be mapped by another address
+ * space, possibly on another CPU; if so that mapping is knocked out
+ * first.
+ *
+ * Synchronization: Takes coremap_spinlock. May block for TLB shootdown,
+ * so the caller must not hold any spinlocks.
  */
 void
 mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
@@ -1259,7 +2524,21 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 	/* Page must be pinned. */
 	KASSERT(coremap[cmix].cm_pinned);
 
-	tlbix = tlb_probe(va, 0);
+	/*
+	 * If another sharer of the page has it mapped, take that
+	 * mapping away. We may sleep (and even change CPUs) doing
+	 * this, so probe afterwards. (The probe loads EntryHi with our
+	 * own ASID, so it doesn't need to be reloaded afterwards; but
+	 * that ASID is per-CPU, so fetch it again each time around.)
+	 */
+	while ((tlbix = tlb_probe((va & TLBHI_VPAGE) |
+				  (curcpu->c_vm.cvm_asid << TLBHI_PIDSHIFT),
+				  0)) < 0 &&
+	       coremap[cmix].cm_tlbix >= 0) {
+		tlb_unmap_page(cmix);
+	}
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+
 	if (tlbix < 0) {
 		KASSERT(coremap[cmix].cm_tlbix == -1);
 		KASSERT(coremap[cmix].cm_cpunum == 0);
@@ -1276,13 +2555,15 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
 	}
 
-	ehi = va & TLBHI_VPAGE;
+	KASSERT(curcpu->c_vm.cvm_asid != 0);
+	ehi = (va & TLBHI_VPAGE) | (curcpu->c_vm.cvm_asid << TLBHI_PIDSHIFT);
 	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
 	if (writable) {
 		elo |= TLBLO_DIRTY;
 	}
 
 	tlb_write(ehi, elo, tlbix);
+	coremap[cmix].cm_referenced = 1;
 
 	/* Unpin the page. */
 	coremap[cmix].cm_pinned = 0;
@@ -35,7 +35,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +60,12 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Size of bounce buffer for I/O that can't go directly to a request */
+#define LHD_BOUNCESECTS 8
+
+/* Max number of kernel buffers of one uio queued at once */
+#define LHD_MAXDIRECT 8
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,15 +102,103 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the hardware on the next sector of the active request.
+ * For writes, the data has to be put in the on-card buffer first.
  */
 static
 void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_request *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+	char *data;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(req->lr_done < req->lr_nsect);
+
+	data = (char *)req->lr_data + req->lr_done * LHD_SECTSIZE;
+	if (req->lr_write) {
+		memcpy(lh->lh_buf, data, LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	lh->lh_headpos = req->lr_sector + req->lr_done;
+
+	/* Tell it what sector we want, and start the operation. */
+	lhd_wreg(lh, LHD_REG_SECT, lh->lh_headpos);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, pick the next request (C-LOOK: the first one
+ * at or above the current head position, or failing that the lowest
+ * one) and start it.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_request **rp, **pick;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	pick = &lh->lh_queue;
+	for (rp = &lh->lh_queue; *rp != NULL; rp = &(*rp)->lr_next) {
+		if ((*rp)->lr_sector >= lh->lh_headpos) {
+			pick = rp;
+			break;
+		}
+	}
+
+	lh->lh_active = *pick;
+	*pick = lh->lh_active->lr_next;
+	lh->lh_active->lr_next = NULL;
+
+	lhd_startsector(lh);
+}
+
+/*
+ * Record that a sector has completed. If that finishes the active
+ * request (or it failed), retire it, start the next one, and hand it
+ * back; otherwise go on to the next sector and return NULL.
+ */
+static
+struct lhd_request *
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *req = lh->lh_active;
+	char *data;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return NULL;
+	}
+
+	if (err == 0) {
+		/* If reading, get the data out of the on-card buffer. */
+		if (!req->lr_write) {
+			data = (char *)req->lr_data +
+				req->lr_done * LHD_SECTSIZE;
+			memcpy(data, lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->lr_done++;
+		if (req->lr_done < req->lr_nsect) {
+			lhd_startsector(lh);
+			return NULL;
+		}
+	}
+
+	req->lr_result = err;
+	lh->lh_active = NULL;
+	lhd_start(lh);
+	return req;
 }
 
 /*
@@ -115,6 +210,8 @@ void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_request *req;
+	void (*callback)(struct lhd_request *);
 	uint32_t val;
 	
 	val = lhd_rdreg(lh, LHD_REG_STAT);
@@ -127,11 +224,111 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		spinlock_acquire(&lh->lh_lock);
+		req = lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		if (req == NULL) {
+			spinlock_release(&lh->lh_lock);
+			break;
+		}
+		/*
+		 * Once lr_complete is set and the lock dropped, a
+		 * waiter may return and free the request, so fetch the
+		 * callback first.
+		 */
+		callback = req->lr_callback;
+		req->lr_complete = true;
+		spinlock_release(&lh->lh_lock);
+		if (callback != NULL) {
+			callback(req);
+		}
+		else {
+			wchan_wakeall(lh->lh_wchan);
+		}
 		break;
 	}
 }
 
+/*
+ * Queue a request. Returns EINVAL if it's empty or runs off the end
+ * of the disk; otherwise the result is reported on completion.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request **rp;
+
+	if (req->lr_nsect == 0 ||
+	    req->lr_sector + req->lr_nsect > lh->lh_dev.d_blocks ||
+	    req->lr_sector + req->lr_nsect < req->lr_sector) {
+		return EINVAL;
+	}
+
+	req->lr_done = 0;
+	req->lr_result = 0;
+	req->lr_complete = false;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	/* Insert in sector order, after any others for the same sector. */
+	rp = &lh->lh_queue;
+	while (*rp != NULL && (*rp)->lr_sector <= req->lr_sector) {
+		rp = &(*rp)->lr_next;
+	}
+	req->lr_next = *rp;
+	*rp = req;
+
+	lhd_start(lh);
+
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+/*
+ * Wait for a request without a callback to complete, and return its
+ * result.
+ */
+int
+lhd_wait(struct lhd_softc *lh, struct lhd_request *req)
+{
+	KASSERT(req->lr_callback == NULL);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!req->lr_complete) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return req->lr_result;
+}
+
+/*
+ * Submit a request and wait for it.
+ */
+static
+int
+lhd_rw(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+       void *data, bool write)
+{
+	struct lhd_request req;
+	int result;
+
+	req.lr_sector = sector;
+	req.lr_nsect = nsect;
+	req.lr_data = data;
+	req.lr_write = write;
+	req.lr_callback = NULL;
+	req.lr_cbdata = NULL;
+
+	result = lhd_submit(lh, &req);
+	if (result) {
+		return result;
+	}
+	return lhd_wait(lh, &req);
+}
+
 /*
  * Function called when we are open()'d.
  */
@@ -193,8 +390,104 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Do I/O directly to or from the kernel buffers of a uio, each of
+ * which is a whole number of sectors. Each buffer is one request;
+ * up to LHD_MAXDIRECT of them are queued together, so a scattered
+ * set of pages going to consecutive sectors (as for swap clusters)
+ * reaches the disk as one sequential run.
+ */
+static
+int
+lhd_io_direct(struct lhd_softc *lh, struct uio *uio, uint32_t sector,
+	      bool write)
+{
+	struct lhd_request reqs[LHD_MAXDIRECT];
+	struct iovec *iov;
+	unsigned i, n;
+	uint32_t nbytes;
+	int result, err;
+
+	while (uio->uio_resid > 0) {
+		n = 0;
+		while (n < LHD_MAXDIRECT && uio->uio_resid > 0) {
+			iov = uio->uio_iov;
+			if (iov->iov_len == 0) {
+				uio->uio_iov++;
+				uio->uio_iovcnt--;
+				continue;
+			}
+			nbytes = iov->iov_len < uio->uio_resid ?
+				iov->iov_len : uio->uio_resid;
+
+			reqs[n].lr_sector = sector;
+			reqs[n].lr_nsect = nbytes / LHD_SECTSIZE;
+			reqs[n].lr_data = iov->iov_kbase;
+			reqs[n].lr_write = write;
+			reqs[n].lr_callback = NULL;
+			reqs[n].lr_cbdata = NULL;
+
+			iov->iov_kbase = (char *)iov->iov_kbase + nbytes;
+			iov->iov_len -= nbytes;
+			uio->uio_offset += nbytes;
+			uio->uio_resid -= nbytes;
+			sector += reqs[n].lr_nsect;
+			n++;
+		}
+
+		/* Queue them all, then wait for them all. */
+		result = 0;
+		for (i=0; i<n; i++) {
+			err = lhd_submit(lh, &reqs[i]);
+			if (err) {
+				result = err;
+				break;
+			}
+		}
+		n = i;
+		for (i=0; i<n; i++) {
+			err = lhd_wait(lh, &reqs[i]);
+			if (err && result == 0) {
+				result = err;
+			}
+		}
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check if a uio can be done with lhd_io_direct: it's in kernel
+ * space and every buffer is a whole number of sectors.
+ */
+static
+bool
+lhd_can_direct(struct uio *uio)
+{
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	if (uio->uio_iovcnt == 1 && uio->uio_iov->iov_len >= uio->uio_resid) {
+		return true;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * If the uio is kernel buffers of whole sectors (as for the buffer
+ * cache and swap), the transfer goes straight into those buffers.
+ * Otherwise go through a bounce buffer, LHD_BOUNCESECTS at a time.
  */
 static
 int
@@ -206,8 +499,9 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = (uio->uio_rw == UIO_WRITE);
+	uint32_t n, nbytes;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +514,51 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
+	}
+
+	if (lhd_can_direct(uio)) {
+		return lhd_io_direct(lh, uio, sector, write);
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	bounce = kmalloc(LHD_BOUNCESECTS * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCESECTS ? len : LHD_BOUNCESECTS;
+		nbytes = n * LHD_SECTSIZE;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		/* Are we writing? If so, get the data first. */
+		if (write) {
+			result = uiomove(bounce, nbytes, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_rw(lh, sector, n, bounce, write);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		/* Are we reading? If so, hand the data back. */
+		if (!write) {
+			result = uiomove(bounce, nbytes, uio);
+			if (result) {
+				break;
+			}
 		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -289,15 +575,14 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
 
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,40 @@
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Disk I/O request.
+ *
+ * A request covers LR_NSECT consecutive sectors starting at
+ * LR_SECTOR, transferred to or from the kernel buffer LR_DATA. The
+ * hardware only moves one sector at a time, but the driver chains the
+ * sectors of a request together at interrupt time, so the submitter
+ * only hears about it once, when the whole request is done.
+ *
+ * Pending requests are kept sorted by sector and served in C-LOOK
+ * order: the disk head sweeps upward, then jumps back to the lowest
+ * pending request.
+ *
+ * If LR_CALLBACK is set, it is called at interrupt time (without any
+ * driver locks held) when the request completes; it must not sleep.
+ * Otherwise the submitter calls lhd_wait to sleep until completion.
+ * Either way the request and its buffer must stay put until then.
+ */
+struct lhd_request {
+	/* Filled in by the submitter */
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	void *lr_data;			/* Kernel buffer */
+	bool lr_write;			/* Direction */
+	void (*lr_callback)(struct lhd_request *);
+	void *lr_cbdata;		/* For the callback's use */
+
+	/* Filled in by the driver */
+	uint32_t lr_done;		/* Sectors transferred so far */
+	int lr_result;			/* Error code on completion */
+	bool lr_complete;		/* Finished (successfully or not) */
+	struct lhd_request *lr_next;	/* Queue link */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +86,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct lhd_request *lh_queue;	/* Pending requests, by sector */
+	struct lhd_request *lh_active;	/* Request the disk is working on */
+	uint32_t lh_headpos;		/* Last sector started */
+	struct wchan *lh_wchan;		/* For lhd_wait */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +98,8 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Asynchronous I/O */
+int lhd_submit(struct lhd_softc *lh, struct lhd_request *req);
+int lhd_wait(struct lhd_softc *lh, struct lhd_request *req);
+
 #endif /* _LAMEBUS_LHD_H_ */
@@ -39,8 +39,10 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -101,6 +103,39 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Count the free blocks, overall and in each allocation group, after
+ * the freemap has been read in. Only blocks below sp_nblocks count;
+ * the bits past the end of the disk are marked in use anyway.
+ */
+static
+int
+sfs_freemap_summarize(struct sfs_fs *sfs)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	unsigned ngroups = SFS_NGROUPS(nblocks);
+	uint32_t i;
+
+	sfs->sfs_groupfree = kmalloc((ngroups > 0 ? ngroups : 1) *
+				     sizeof(uint32_t));
+	if (sfs->sfs_groupfree == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<ngroups; i++) {
+		sfs->sfs_groupfree[i] = 0;
+	}
+
+	sfs->sfs_freeblocks = 0;
+	for (i=0; i<nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_groupfree[i / SFS_GROUPBLOCKS]++;
+			sfs->sfs_freeblocks++;
+		}
+	}
+	sfs->sfs_allochint = 0;
+	return 0;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +146,10 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct sfs_vnode *sv, **vnodes;
+	unsigned i, j, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +182,60 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/*
+	 * Collect the loaded vnodes, with a reference to each. Vnodes
+	 * are locked before the table, so we can't lock them while
+	 * holding the table lock. Skip ones being reclaimed; sfs_reclaim
+	 * writes their inodes itself, and they can't take new references.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	vnodes = kmalloc((num > 0 ? num : 1) * sizeof(struct sfs_vnode *));
+	if (vnodes == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
 	}
+	j = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_reclaiming) {
+				continue;
+			}
+			VOP_INCREF(&sv->sv_v);
+			vnodes[j++] = sv;
+		}
+	}
+	KASSERT(j <= num);
+	num = j;
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Sync each one. This only moves the inodes into the buffer
+	 * cache; the cache is flushed below.
+	 */
+	result = 0;
+	for (j=0; j<num; j++) {
+		sv = vnodes[j];
+		if (result == 0) {
+			lock_acquire(sv->sv_lock);
+			result = sfs_sync_inode(sv);
+			lock_release(sv->sv_lock);
+		}
+		VOP_DECREF(&sv->sv_v);
+	}
+	kfree(vnodes);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,13 +245,20 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Now write out everything that's dirty in the buffer cache. */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -189,13 +272,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name doesn't change while mounted. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,31 +287,46 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer won't hand out our root while we're being unmounted,
+	 * so once this is true it stays true.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Make sure nothing is left dirty in the buffer cache. */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_destroy(sfs);
+	lock_destroy(sfs->sfs_freemaplock);
+	kfree(sfs->sfs_groupfree);
 	bitmap_destroy(sfs->sfs_freemap);
 	
-	/* The vfs layer takes care of the device for us */
-	(void)sfs->sfs_device;
+	/*
+	 * The vfs layer takes care of the device for us, but the
+	 * device's blocks must not outlive us in the buffer cache.
+	 */
+	buffer_drop(sfs->sfs_device);
 
 	/* Destroy the fs object */
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -257,8 +351,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -268,6 +360,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	KASSERT(SFS_BLOCKSIZE == BUFFER_SIZE);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
@@ -278,23 +371,20 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate vnode table */
+	result = sfs_vnhash_init(sfs);
+	if (result) {
 		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		return result;
 	}
 
 	/* Set the device so we can use sfs_rblock() */
@@ -303,9 +393,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_destroy(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,9 +405,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop(dev);
+		sfs_vnhash_destroy(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
@@ -333,19 +422,36 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop(dev);
+		sfs_vnhash_destroy(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		buffer_drop(dev);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vnhash_destroy(sfs);
+		kfree(sfs);
+		return result;
+	}
+	result = sfs_freemap_summarize(sfs);
+	if (result) {
+		buffer_drop(dev);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_destroy(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		buffer_drop(dev);
+		kfree(sfs->sfs_groupfree);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vnhash_destroy(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
 
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
@@ -361,7 +467,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
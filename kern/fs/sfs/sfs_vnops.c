@@ -43,11 +43,15 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
+static void sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
 
 ////////////////////////////////////////////////////////////
 //
@@ -58,16 +62,29 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), SFS_BLOCKSIZE);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
-static
+/*
+ * Write an on-disk inode structure back out. This only puts it in the
+ * buffer cache; it reaches the disk when the cache is synced. The
+ * vnode must be locked.
+ */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
@@ -84,26 +101,162 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Blocks are allocated near a goal block: the caller passes the
+ * block it would like, usually the one after the file's previous
+ * block, or 0 for no preference, in which case we start from
+ * sfs_allochint, which moves forward as blocks are handed out. The
+ * per-group free counts let the search skip full parts of the disk,
+ * and sfs_freeblocks tells us at once when there's no space at all.
+ */
+
+/*
+ * Mark a block in use, or free, keeping the free counts up to date.
+ * The freemap lock must be held.
+ */
+static
+void
+sfs_btake(struct sfs_fs *sfs, uint32_t diskblock)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(sfs->sfs_freeblocks > 0);
+
+	bitmap_mark(sfs->sfs_freemap, diskblock);
+	sfs->sfs_freeblocks--;
+	sfs->sfs_groupfree[diskblock / SFS_GROUPBLOCKS]--;
+	sfs->sfs_freemapdirty = true;
+}
+
+static
+void
+sfs_bgive(struct sfs_fs *sfs, uint32_t diskblock)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	sfs->sfs_freeblocks++;
+	sfs->sfs_groupfree[diskblock / SFS_GROUPBLOCKS]++;
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Find a free block, looking first at GOAL and then onward, wrapping
+ * around the end of the disk. Does not mark the block. The freemap
+ * lock must be held.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_bfind(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	unsigned ngroups = SFS_NGROUPS(nblocks);
+	unsigned first, group, i;
+	unsigned start, end, index;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_freeblocks == 0) {
+		return ENOSPC;
+	}
+	if (goal == 0 || goal >= nblocks) {
+		goal = sfs->sfs_allochint;
+	}
+
+	/*
+	 * Search the rest of the goal's group, then each following
+	 * group that has anything free, and finally the part of the
+	 * goal's group before the goal.
+	 */
+	first = goal / SFS_GROUPBLOCKS;
+	for (i=0; i<=ngroups; i++) {
+		group = (first + i) % ngroups;
+		if (sfs->sfs_groupfree[group] == 0) {
+			continue;
+		}
+		start = group * SFS_GROUPBLOCKS;
+		end = start + SFS_GROUPBLOCKS;
+		if (end > nblocks) {
+			end = nblocks;
+		}
+		if (i == 0) {
+			start = goal;
+		}
+		else if (i == ngroups) {
+			end = goal;
+		}
+		if (bitmap_findfree(sfs->sfs_freemap, start, end, &index)==0) {
+			*diskblock = index;
+			return 0;
+		}
+	}
+
+	panic("sfs: %u blocks free but none found in freemap\n",
+	      sfs->sfs_freeblocks);
+	return ENOSPC;
+}
+
+/*
+ * Allocate a run of up to WANT consecutive blocks near GOAL. At least
+ * one block is allocated; *GOT is set to how many were.
+ */
+static
+int
+sfs_balloc_run(struct sfs_fs *sfs, uint32_t goal, uint32_t want,
+	       uint32_t *diskblock, uint32_t *got)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t block, n, i;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	KASSERT(want > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_bfind(sfs, goal, &block);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
 
-	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
-		panic("sfs: balloc: invalid block %u\n", *diskblock);
+	n = 0;
+	do {
+		sfs_btake(sfs, block + n);
+		n++;
+	} while (n < want && block + n < nblocks &&
+		 !bitmap_isset(sfs->sfs_freemap, block + n));
+
+	sfs->sfs_allochint = (block + n < nblocks) ? block + n : 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	/*
+	 * Clear blocks before returning them. Nobody else can reach
+	 * them yet, so this needn't be under the freemap lock.
+	 */
+	for (i=0; i<n; i++) {
+		result = sfs_clearblock(sfs, block + i);
+		if (result) {
+			lock_acquire(sfs->sfs_freemaplock);
+			for (i=0; i<n; i++) {
+				sfs_bgive(sfs, block + i);
+			}
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
 	}
 
-	/* Clear block before returning it */
-	return sfs_clearblock(sfs, *diskblock);
+	*diskblock = block;
+	*got = n;
+	return 0;
+}
+
+/*
+ * Allocate a block near GOAL (0 for no preference).
+ */
+static
+int
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
+{
+	uint32_t got;
+
+	return sfs_balloc_run(sfs, goal, 1, diskblock, &got);
 }
 
 /*
@@ -113,8 +266,9 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_bgive(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,44 +278,89 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * The allocation goal for the block that follows PREV on disk: the
+ * next block, or no preference if PREV isn't mapped.
+ */
+static
+uint32_t
+sfs_nextgoal(uint32_t prev)
+{
+	return prev == 0 ? 0 : prev + 1;
+}
+
+/*
+ * Get the disk block number of the file's indirect block, allocating
+ * one if DOALLOC is set and there isn't one yet. 0 means there is
+ * none.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, int doalloc, uint32_t *idblockret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t idblock;
+	int result;
+
+	idblock = sv->sv_i.sfi_indirect;
+
+	if (idblock==0 && doalloc) {
+		/* Put it after the last direct block, ahead of what it maps */
+		result = sfs_balloc(sfs,
+				sfs_nextgoal(sv->sv_i.sfi_direct[SFS_NDIRECT-1]),
+				&idblock);
+		if (result) {
+			return result;
+		}
+
+		/* Remember the block we just allocated */
+		sv->sv_i.sfi_indirect = idblock;
+
+		/* Mark the inode dirty */
+		sv->sv_dirty = true;
+	}
+
+	*idblockret = idblock;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated, next to the file's previous block if possible.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuffer;
+	uint32_t *idbuf;
 	uint32_t block;
 	uint32_t idblock;
 	uint32_t idnum, idoff;
+	uint32_t goal;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +375,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			goal = fileblock > 0 ?
+				sfs_nextgoal(sv->sv_i.sfi_direct[fileblock-1]) : 0;
+			result = sfs_balloc(sfs, goal, &block);
 			if (result) {
 				return result;
 			}
@@ -218,74 +419,175 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	result = sfs_bmap_indirect(sv, doalloc, &idblock);
+	if (result) {
+		return result;
+	}
 
-	if (idblock==0 && !doalloc) {
+	if (idblock==0) {
 		/*
 		 * There's no indirect block allocated. We weren't
 		 * asked to allocate anything, so pretend the indirect
 		 * block was filled with all zeros.
 		 */
+		KASSERT(!doalloc);
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+
+	/*
+	 * Get the indirect block from the buffer cache. (sfs_balloc
+	 * will have left a zeroed copy there if we just allocated it.)
+	 */
+	result = buffer_read(sfs->sfs_device, idblock, &idbuffer);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(idbuffer);
+
+	/* Get the block out of the indirect block */
+	block = idbuf[idoff];
+
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		goal = idoff > 0 ? sfs_nextgoal(idbuf[idoff-1]) : idblock + 1;
+		result = sfs_balloc(sfs, goal, &block);
 		if (result) {
+			buffer_release(idbuffer);
 			return result;
 		}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		/* Remember the block we allocated; the indirect block is dirty */
+		idbuf[idoff] = block;
+		buffer_mark_dirty(idbuffer);
+	}
 
-		/* Mark the inode dirty */
+	buffer_release(idbuffer);
+
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Record that FILEBLOCK, which is currently unmapped, lives in disk
+ * block DISKBLOCK.
+ */
+static
+int
+sfs_bmap_set(struct sfs_vnode *sv, uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuffer;
+	uint32_t *idbuf;
+	uint32_t idblock;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (fileblock < SFS_NDIRECT) {
+		KASSERT(sv->sv_i.sfi_direct[fileblock] == 0);
+		sv->sv_i.sfi_direct[fileblock] = diskblock;
 		sv->sv_dirty = true;
+		return 0;
+	}
+
+	fileblock -= SFS_NDIRECT;
+	KASSERT(fileblock < SFS_DBPERIDB);
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	result = sfs_bmap_indirect(sv, 1, &idblock);
+	if (result) {
+		return result;
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+	result = buffer_read(sfs->sfs_device, idblock, &idbuffer);
+	if (result) {
+		return result;
 	}
+	idbuf = buffer_map(idbuffer);
+	KASSERT(idbuf[fileblock] == 0);
+	idbuf[fileblock] = diskblock;
+	buffer_mark_dirty(idbuffer);
+	buffer_release(idbuffer);
+	return 0;
+}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+/*
+ * Before writing COUNT whole blocks starting at FILEBLOCK, allocate
+ * the unmapped ones in as few contiguous runs as possible, so the
+ * file stays together on disk. Anything this doesn't map is
+ * allocated a block at a time by sfs_bmap later.
+ */
+static
+int
+sfs_bmap_prealloc(struct sfs_vnode *sv, uint32_t fileblock, uint32_t count)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	const uint32_t maxblocks = SFS_NDIRECT + SFS_DBPERIDB;
+	uint32_t block, prev, want, first, got, i;
+	int result;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (fileblock >= maxblocks) {
+		return EFBIG;
+	}
+	if (count > maxblocks - fileblock) {
+		count = maxblocks - fileblock;
+	}
+
+	while (count > 0) {
+		result = sfs_bmap(sv, fileblock, 0, &block);
 		if (result) {
 			return result;
 		}
+		if (block != 0) {
+			fileblock++;
+			count--;
+			continue;
+		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Count the unmapped blocks from here */
+		for (want=1; want<count; want++) {
+			result = sfs_bmap(sv, fileblock + want, 0, &block);
+			if (result) {
+				return result;
+			}
+			if (block != 0) {
+				break;
+			}
+		}
+
+		prev = 0;
+		if (fileblock > 0) {
+			result = sfs_bmap(sv, fileblock - 1, 0, &prev);
+			if (result) {
+				return result;
+			}
+		}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+		result = sfs_balloc_run(sfs, sfs_nextgoal(prev), want,
+					&first, &got);
 		if (result) {
 			return result;
 		}
-	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: Data block %u (block %u of file %u) marked free\n",
-		      block, fileblock, sv->sv_ino);
+		for (i=0; i<got; i++) {
+			result = sfs_bmap_set(sv, fileblock + i, first + i);
+			if (result) {
+				for (; i<got; i++) {
+					sfs_bfree(sfs, first + i);
+				}
+				return result;
+			}
+		}
+
+		fileblock += got;
+		count -= got;
 	}
-	*diskblock = block;
 	return 0;
 }
 
@@ -308,16 +610,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuffer;
+	char *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +634,33 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuffer);
 	if (result) {
 		return result;
 	}
+	iobuf = buffer_map(iobuffer);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is now dirty (even if uiomove
+	 * failed partway); the cache will write it back later.
 	 */
+	result = uiomove(iobuf+skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuffer);
 	}
 
-	return 0;
+	buffer_release(iobuffer);
+	return result;
 }
 
 /*
@@ -383,14 +671,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuffer;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -413,30 +698,31 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. When writing, the whole block is
+	 * about to be overwritten, so there's no need to read it first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuffer);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuffer);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(buffer_map(iobuffer), SFS_BLOCKSIZE, uio);
+	if (result && uio->uio_rw == UIO_WRITE) {
+		/* don't keep a half-overwritten copy of the block */
+		buffer_abandon(iobuffer);
+		return result;
+	}
+	if (uio->uio_rw == UIO_WRITE) {
+		buffer_mark_dirty(iobuffer);
+	}
 
+	buffer_release(iobuffer);
 	return result;
 }
 
@@ -449,6 +735,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
 	uint32_t nblocks, i;
+	uint32_t fileblock, endblock, eofblock;
+	bool prealloc = false;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -506,6 +794,27 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	if (uio->uio_rw == UIO_WRITE && nblocks > 1) {
+		/*
+		 * Lay out the blocks past EOF contiguously if we can.
+		 * Blocks inside the file are either mapped already or
+		 * holes, which sfs_blockio fills one at a time.
+		 */
+		fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+		endblock = fileblock + nblocks;
+		eofblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+		if (fileblock < eofblock) {
+			fileblock = eofblock;
+		}
+		if (endblock > fileblock + 1) {
+			prealloc = true;
+			result = sfs_bmap_prealloc(sv, fileblock,
+						   endblock - fileblock);
+			if (result) {
+				goto out;
+			}
+		}
+	}
 	for (i=0; i<nblocks; i++) {
 		result = sfs_blockio(sv, uio);
 		if (result) {
@@ -534,6 +843,14 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/*
+	 * If the write stopped short, give back preallocated blocks it
+	 * didn't reach. They're past EOF, so nothing else would.
+	 */
+	if (prealloc && result) {
+		(void)sfs_dotruncate(sv, sv->sv_i.sfi_size);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -546,36 +863,43 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 // Directory I/O
 
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Number of directory entries in a block. Directory scans read a
+ * block at a time straight from the buffer cache, rather than an entry
+ * at a time through sfs_io, so each block is looked up once.
+ */
+#define SFS_DIRPERBLOCK ((int)(SFS_BLOCKSIZE / sizeof(struct sfs_dir)))
+
+/*
+ * Get block FILEBLOCK of directory SV from the buffer cache, handing
+ * back the buffer and the entries in it. The caller releases the
+ * buffer with buffer_release. If no block is allocated there, both
+ * come back NULL, and all the slots in the block count as free.
  */
 static
 int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+sfs_dir_getblock(struct sfs_vnode *sv, uint32_t fileblock,
+		 struct buf **bufret, const struct sfs_dir **sdret)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t diskblock;
 	int result;
 
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
-
-	/* Set up a uio to do the read */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
-
-	/* do it */
-	result = sfs_io(sv, &ku);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
 
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	if (diskblock == 0) {
+		*bufret = NULL;
+		*sdret = NULL;
+		return 0;
 	}
 
-	/* Done */
+	result = buffer_read(sfs->sfs_device, diskblock, bufret);
+	if (result) {
+		return result;
+	}
+	*sdret = buffer_map(*bufret);
 	return 0;
 }
 
@@ -638,8 +962,10 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 
 /*
  * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * return its inode number, its slot, and/or the slot number of the
+ * first empty directory slot if one is found. (*EMPTYSLOT should be
+ * -1 to begin with.) The search stops at the name, so if the name
+ * exists there may be an earlier empty slot that isn't reported.
  */
 
 static
@@ -647,42 +973,54 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
+	const struct sfs_dir *sds;
 	struct sfs_dir tsd;
-	int found = 0;
+	struct buf *buf;
+	bool found = false;
 	int nentries = sfs_dir_nentries(sv);
-	int i, result;
+	int base, i, n, result;
 
-	/* For each slot... */
-	for (i=0; i<nentries; i++) {
-
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
+	/* For each block... */
+	for (base=0; base<nentries && !found; base += SFS_DIRPERBLOCK) {
+		result = sfs_dir_getblock(sv, base / SFS_DIRPERBLOCK,
+					  &buf, &sds);
 		if (result) {
 			return result;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
-			}
+
+		n = nentries - base;
+		if (n > SFS_DIRPERBLOCK) {
+			n = SFS_DIRPERBLOCK;
 		}
-		else {
+
+		/* ...look at each slot in it */
+		for (i=0; i<n; i++) {
+			if (sds == NULL || sds[i].sfd_ino == SFS_NOINO) {
+				/* Free slot - report it back if requested */
+				if (emptyslot != NULL && *emptyslot < 0) {
+					*emptyslot = base + i;
+				}
+				continue;
+			}
+
 			/* Ensure null termination, just in case */
+			memcpy(&tsd, &sds[i], sizeof(tsd));
 			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
 			if (!strcmp(tsd.sfd_name, name)) {
-
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
-
-				found = 1;
+				found = true;
 				if (slot != NULL) {
-					*slot = i;
+					*slot = base + i;
 				}
 				if (ino != NULL) {
 					*ino = tsd.sfd_ino;
 				}
+				break;
 			}
 		}
+
+		if (buf != NULL) {
+			buffer_release(buf);
+		}
 	}
 
 	return found ? 0 : ENOENT;
@@ -801,7 +1139,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1213,18 @@ static
 int
 sfs_lastclose(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	/*
+	 * Write the inode back to the buffer cache. Don't force
+	 * anything to disk; that happens on sync or fsync.
+	 */
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -890,69 +1238,83 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Mark the vnode as being reclaimed, under the vnode table
+	 * lock, so sfs_loadvnode won't hand it out again while we're
+	 * getting rid of it. The I/O below is done without the table
+	 * lock, so loading other vnodes doesn't wait for it.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	KASSERT(!sv->sv_reclaiming);
+	sv->sv_reclaiming = true;
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Ours is the only reference and nobody can get another, so
+	 * this doesn't wait for anyone.
+	 */
+	lock_acquire(sv->sv_lock);
 
 	/* If there are no on-disk references to the file either, erase it. */
+	result = 0;
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+		result = sfs_dotruncate(sv, 0);
 	}
 
 	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+
+	lock_release(sv->sv_lock);
+
+	lock_acquire(sfs->sfs_vnlock);
 	if (result) {
-		vfs_biglock_release();
+		/* Keep the vnode, and the reference, as before. */
+		sv->sv_reclaiming = false;
+		cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * If there are no on-disk references, discard the inode. This
+	 * comes after the vnode is out of the table, so a new file
+	 * given the same inode doesn't find the old vnode there.
+	 */
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
-
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
-
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -971,9 +1333,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1352,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1395,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1417,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once loaded, so no lock is needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,44 +1461,48 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result == 0) {
+		/*
+		 * The buffer cache doesn't know which blocks belong to
+		 * which file, so flush everything on the device.
+		 */
+		result = buffer_sync(sfs->sfs_device);
+	}
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM system reads and writes the pages of the
+ * mapping with VOP_READ and VOP_WRITE, so there is nothing for us to
+ * set up; any regular file can be mapped. (Directories have ISDIR in
+ * this slot.)
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Truncate (or extend) a file. Used for ftruncate() and from
+ * sfs_reclaim. The vnode must be locked.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
-	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuffer;
+	uint32_t *idbuf;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -1147,9 +1512,7 @@ sfs_truncate(struct vnode *v, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1176,13 +1539,13 @@ sfs_truncate(struct vnode *v, off_t len)
 	if (blocklen < highblock && idblock != 0) {
 		/* We're past the proposed EOF; may need to free stuff */
 
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		/* Get the indirect block */
+		result = buffer_read(sfs->sfs_device, idblock, &idbuffer);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-		
+		idbuf = buffer_map(idbuffer);
+
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
@@ -1205,13 +1568,10 @@ sfs_truncate(struct vnode *v, off_t len)
 			sv->sv_dirty = true;
 		}
 		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+			/* The indirect block is dirty; the cache writes it */
+			buffer_mark_dirty(idbuffer);
 		}
+		buffer_release(idbuffer);
 	}
 
 	/* Set the file size */
@@ -1220,10 +1580,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +1635,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +1654,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +1676,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	dcache_invalidate(v, name);
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +1710,28 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* No links to directories (which would also mean locking it twice) */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EISDIR;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	dcache_invalidate(dir, name);
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +1747,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +1760,19 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
+		dcache_invalidate(dir, name);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,7 +1792,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
@@ -1409,7 +1800,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +1821,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +1836,20 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	dcache_invalidate(d1, n1);
+	dcache_invalidate(d2, n2);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +1863,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +1887,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +1899,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1510,7 +1906,7 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. Answers, including "no such file", go in the name cache.
  */
 static
 int
@@ -1520,22 +1916,31 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return ENOTDIR;
 	}
 	
+	if (dcache_lookup(v, path, ret)) {
+		lock_release(sv->sv_lock);
+		return *ret != NULL ? 0 : ENOENT;
+	}
+
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
-		vfs_biglock_release();
+		if (result == ENOENT) {
+			dcache_enter(v, path, NULL);
+		}
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	dcache_enter(v, path, &final->sv_v);
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1642,6 +2047,161 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+////////////////////////////////////////////////////////////
+//
+// Table of loaded vnodes
+//
+// Loaded vnodes are kept on hash chains keyed by inode number. The
+// number of chains is a power of 2 and doubles whenever the average
+// chain gets longer than SFS_VNHASH_LOAD, so finding, adding, and
+// removing a vnode take constant time on average. All of it is
+// protected by sfs_vnlock.
+
+#define SFS_VNHASH_INITSIZE	32
+#define SFS_VNHASH_LOAD		2
+
+#define SFS_VNHASH(sfs, ino)	((ino) & ((sfs)->sfs_vnhashsize - 1))
+
+/*
+ * Set up an empty table and its lock. Called at mount time.
+ */
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		return ENOMEM;
+	}
+
+	sfs->sfs_vncv = cv_create("sfs vnodes");
+	if (sfs->sfs_vncv == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		cv_destroy(sfs->sfs_vncv);
+		lock_destroy(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_nvnodes = 0;
+	return 0;
+}
+
+/*
+ * Free the table, which must be empty. Called at unmount time.
+ */
+void
+sfs_vnhash_destroy(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+	sfs->sfs_vnhashsize = 0;
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
+}
+
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[SFS_VNHASH(sfs, ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of chains. If we can't get the memory, just keep
+ * using the table we have; it gets slower but still works.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newhash, *sv, *next;
+	unsigned i, newsize, ix;
+
+	newsize = sfs->sfs_vnhashsize * 2;
+	newhash = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			ix = sv->sv_ino & (newsize - 1);
+			sv->sv_hashnext = newhash[ix];
+			newhash[ix] = sv;
+		}
+	}
+
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashsize = newsize;
+}
+
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned ix;
+
+	KASSERT(sfs_vnhash_find(sfs, sv->sv_ino) == NULL);
+
+	if (sfs->sfs_nvnodes >= sfs->sfs_vnhashsize * SFS_VNHASH_LOAD) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	ix = SFS_VNHASH(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[ix];
+	sfs->sfs_vnhash[ix] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	svp = &sfs->sfs_vnhash[SFS_VNHASH(sfs, sv->sv_ino)];
+	while (*svp != sv) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+		svp = &(*svp)->sv_hashnext;
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
@@ -1651,42 +2211,47 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/*
+	 * Look in the vnodes table. If the vnode is on its way out,
+	 * wait for that to finish and look again.
+	 */
+	while ((sv = sfs_vnhash_find(sfs, ino)) != NULL && sv->sv_reclaiming) {
+		cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+	}
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,7 +2264,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1736,20 +2303,20 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_reclaiming = false;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_insert(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,68 +2334,80 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
 
+/*
+ * Read the name in the first used directory slot at or after the
+ * slot number in uio_offset, and leave uio_offset at the slot after
+ * it. Empty slots are skipped a block at a time. At the end of the
+ * directory nothing is transferred, which the caller sees as EOF.
+ */
 int 
-sfs_getdirentry(struct vnode *vnode, struct uio *uio)
+sfs_getdirentry(struct vnode *v, struct uio *uio)
 {
-	
-    int entries;
-    int result;
-    int offset;
-    int resid;
-    struct sfs_dir sd;
-    struct sfs_vnode *v;
-
-    //set the offsets and the resid from the given uio
-    offset = uio->uio_offset;
-    resid = uio->uio_resid;
-
-    v = vnode->vn_data;
-
-    vfs_biglock_acquire();
-
-    entries = sfs_dir_nentries(v);
-
-    //entries should be bigger than the offset of uio
-    if (entries < offset) {
-        vfs_biglock_release();
-        return ENOENT;
-    }
-
-    while(true) {
-        result = sfs_readdir(v, &sd, uio->uio_offset);
-        if(result) {
-            vfs_biglock_release();
-            return result;
-       }
-
-       if(sd.sfd_ino == SFS_NOINO) {
-            offset++;
-            if(entries < offset) {
-                vfs_biglock_release();
-                return ENOENT;
-            }
-            uio->uio_offset++;
-            continue;
-        }
-        if(!result) {
-            break;
-       }
-    }
-    
-    result = uiomove(sd.sfd_name, strlen(sd.sfd_name), uio);
-    uio->uio_offset = offset + 1;
-    vfs_biglock_release();
-    return 0;
+	struct sfs_vnode *sv = v->vn_data;
+	const struct sfs_dir *sds;
+	struct sfs_dir tsd;
+	struct buf *buf;
+	int nentries, slot, base, n, i;
+	bool found = false;
+	int result;
+
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
+
+	nentries = sfs_dir_nentries(sv);
+	slot = uio->uio_offset < nentries ? uio->uio_offset : nentries;
+
+	while (slot < nentries && !found) {
+		base = slot - slot % SFS_DIRPERBLOCK;
+		result = sfs_dir_getblock(sv, base / SFS_DIRPERBLOCK,
+					  &buf, &sds);
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+
+		n = nentries - base;
+		if (n > SFS_DIRPERBLOCK) {
+			n = SFS_DIRPERBLOCK;
+		}
+
+		for (i = slot - base; i < n; i++) {
+			if (sds != NULL && sds[i].sfd_ino != SFS_NOINO) {
+				memcpy(&tsd, &sds[i], sizeof(tsd));
+				found = true;
+				break;
+			}
+		}
+		slot = base + i;
+
+		if (buf != NULL) {
+			buffer_release(buf);
+		}
+	}
+
+	if (!found) {
+		/* end of directory */
+		uio->uio_offset = slot;
+		lock_release(sv->sv_lock);
+		return 0;
+	}
+
+	/* Ensure null termination, just in case */
+	tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+	result = uiomove(tsd.sfd_name, strlen(tsd.sfd_name), uio);
+	uio->uio_offset = slot + 1;
+
+	lock_release(sv->sv_lock);
+	return result;
 }
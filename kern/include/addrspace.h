@@ -41,6 +41,7 @@
 
 struct vnode;
 struct vm_object; /* from vmprivate.h */
+struct pagetable; /* from vmprivate.h */
 
 DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
 
@@ -50,7 +51,8 @@ DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
  *
  * In the solution set VM, the address space contains an array of
  * vm_objects. Normally there will be one each for text, data/bss,
- * stack, and heap. More can be added if needed.
+ * stack, and heap. More can be added if needed. The page table caches
+ * the lpages of the vm_objects by virtual address.
  */
 
 struct addrspace {
@@ -65,6 +67,10 @@ struct addrspace {
 #else
         /* Add additional address space objects here as necessary. */
         struct vm_object_array *as_objects;
+        struct pagetable *as_pagetable;		/* lpage lookup cache */
+        struct vm_object *as_heap;		/* heap, for sbrk */
+        vaddr_t as_heapend;			/* current break */
+        struct addrspace_machdep as_machdep;	/* TLB ASIDs */
 #endif
 };
 
@@ -100,6 +106,13 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_file - back part of a region with a file, so that its
+ *                pages are read in from the file when first touched
+ *                instead of being loaded at exec time. (Not in dumbvm.)
+ *
+ *    as_complete_load also sets up an empty heap region above the
+ *    program's segments, which as_sbrk then grows and shrinks.
  */
 
 struct addrspace *as_create(void);
@@ -121,13 +134,27 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if !OPT_DUMBVM
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t memsize, size_t filesize,
+                                 int writeable);
+#endif
 
 
 /*
  * as_fault - handle fault in (the current) address space.
  * as_sbrk - adjust the heap, like the sbrk() system call.
+ * as_mmap - map a file into the address space, like mmap().
+ * as_munmap - remove a mapping made by as_mmap.
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
+#if !OPT_DUMBVM
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak);
+int as_mmap(struct addrspace *as, struct vnode *v, off_t offset,
+	    size_t len, int writeable, int shared, vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+#endif
 
 /*
  * Functions in loadelf.c
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * A fixed pool of block-sized buffers shared by all filesystems that
+ * do block I/O. Buffers are named by (device, block number), found
+ * by hashing, and recycled in LRU order. Writes are write-back: a
+ * dirty buffer goes to disk when it is evicted or when its device is
+ * synced, not when it is modified.
+ *
+ * Each buffer handed out is busy (held exclusively by the caller)
+ * until it is released; other threads wanting the same block wait.
+ * A thread must not try to get a block it already holds.
+ *
+ * Functions:
+ *     buffer_bootstrap   - allocate the buffer pool at boot time.
+ *     buffer_read        - get the buffer for a block, reading it from
+ *                          disk if it is not already cached.
+ *     buffer_get         - get the buffer for a block without reading
+ *                          it. The caller must overwrite the entire
+ *                          block (and mark it dirty) before releasing.
+ *     buffer_map         - return a pointer to the buffer's data.
+ *     buffer_mark_dirty  - note that the buffer's data has been changed.
+ *     buffer_release     - give back a buffer gotten with buffer_read
+ *                          or buffer_get.
+ *     buffer_abandon     - give back a buffer whose contents were
+ *                          partly overwritten by a failed copy.
+ *     buffer_sync        - write out all dirty buffers of a device.
+ *     buffer_drop        - discard all (clean) buffers of a device, as
+ *                          on unmount. None may be in use.
+ *     buffer_printstats  - print hit/miss and I/O counts.
+ *
+ * The device must have a block size of BUFFER_SIZE.
+ */
+
+#define BUFFER_SIZE	512
+
+struct buf;		/* Opaque. */
+struct device;		/* in <device.h> */
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_abandon(struct buf *b);
+
+int buffer_sync(struct device *dev);
+void buffer_drop(struct device *dev);
+
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
@@ -36,6 +36,27 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Per-cpu kmalloc cache: for each subpage size class, a stack
+ * ("magazine") of free blocks that this cpu can hand out and take
+ * back without touching the global heap lock. See vm/kmalloc.c.
+ */
+#define KMALLOC_NSIZES   8
+#define KMALLOC_MAGSIZE  16
+
+struct kmalloc_magazine {
+	unsigned km_count;			/* Blocks in km_blocks */
+	void *km_blocks[KMALLOC_MAGSIZE];
+	uint32_t km_hits;			/* Calls served locally */
+	uint32_t km_misses;			/* Calls that took the lock */
+};
+
+struct kmalloc_cpucache {
+	struct kmalloc_magazine kc_mags[KMALLOC_NSIZES];
+	unsigned kc_cpunum;			/* For stats printing */
+	struct kmalloc_cpucache *kc_next;	/* List of all of them */
+};
+
 /*
  * Per-cpu structure
  *
@@ -61,6 +82,7 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	struct cpu_vm_machdep c_vm;	/* Machine-dependent VM bits */
+	struct kmalloc_cpucache c_kmalloc; /* kmalloc magazines */
 
 	/*
 	 * Accessed by other cpus.
@@ -98,7 +120,8 @@ struct cpu {
  * cpu_create creates a cpu; it is suitable for calling from driver-
  * or bus-specific code that looks for secondary CPUs.
  *
- * cpu_create calls cpu_machdep_init.
+ * cpu_create calls cpu_machdep_init, and kmalloc_cpu_init (in
+ * vm/kmalloc.c) to set up the cpu's kmalloc magazines.
  *
  * cpu_start_secondary is the platform-dependent assembly language
  * entry point for new CPUs; it can be found in start.S. It calls
@@ -107,6 +130,7 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+void kmalloc_cpu_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
@@ -153,6 +177,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * To batch shootdowns, queue several with ipi_tlbshootdown_queue,
+ * which doesn't interrupt the target, and then send them all with one
+ * ipi_tlbshootdown_send per target CPU.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +194,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_queue(unsigned targetcpu,
+			    const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_send(unsigned targetcpu);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Name cache (dcache).
+ *
+ * Maps (directory vnode, name) to the vnode that name refers to, so
+ * that looking up a name already looked up costs a hash probe instead
+ * of a directory scan and an inode load. A name that was looked up
+ * and found not to exist is remembered too (a negative entry).
+ *
+ * An entry holds a reference to its directory and to its target, so
+ * cached vnodes stay loaded. The filesystem fills the cache from its
+ * lookup routine and must invalidate an entry whenever the name it
+ * covers is created, removed, or renamed. The table is a fixed size
+ * and entries are recycled in LRU order.
+ *
+ * Functions:
+ *     dcache_bootstrap   - allocate the cache at boot time.
+ *     dcache_lookup      - probe for NAME in DIR. Returns true on a hit,
+ *                          with *RET set to the target (referenced) or
+ *                          to NULL for a negative entry. Returns false
+ *                          if the name is not cached.
+ *     dcache_enter       - record that NAME in DIR is TARGET, or does
+ *                          not exist if TARGET is NULL.
+ *     dcache_invalidate  - forget NAME in DIR.
+ *     dcache_closefs     - forget every entry on FS and refuse new
+ *                          ones, as before unmount.
+ *     dcache_openfs      - accept entries on FS again, after the
+ *                          unmount has succeeded or failed.
+ *     dcache_printstats  - print hit/miss counts.
+ *
+ * None of these may be called with a spinlock held.
+ */
+
+struct vnode;		/* in <vnode.h> */
+struct fs;		/* in <fs.h> */
+
+void dcache_bootstrap(void);
+
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *target);
+void dcache_invalidate(struct vnode *dir, const char *name);
+void dcache_closefs(struct fs *fs);
+void dcache_openfs(struct fs *fs);
+
+void dcache_printstats(void);
+
+#endif /* _DCACHE_H_ */
@@ -58,6 +58,9 @@ struct device {
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
+/* Get the device behind a device vnode (NULL if it isn't one). */
+struct device *dev_fromvnode(struct vnode *v);
+
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out fixed-size objects that are kept in their
+ * constructed state while they sit on the cache's free list. The
+ * constructor runs only when a fresh object has to be allocated from
+ * kmalloc, and the destructor only when an object is finally given
+ * back to kmalloc because the free list is full. Objects must
+ * therefore be returned with kmem_cache_free in the same state the
+ * constructor left them in: wait channels empty, spinlocks not held,
+ * and so forth.
+ *
+ * The ctor returns 0 or an error code; on failure it must undo
+ * whatever it did. Either function pointer may be NULL.
+ *
+ * The structure is exposed only so caches can be defined statically
+ * with KMEM_CACHE_INITIALIZER, which is needed for caches that are
+ * used before anything has a chance to call kmem_cache_create (e.g.
+ * the lock cache). Don't touch the fields.
+ */
+
+#include <spinlock.h>
+
+/* Upper bound on the number of free objects a cache will hold. */
+#define KMEM_CACHE_MAXFREE	32
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	unsigned kc_maxfree;		/* free objects to keep */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects the below */
+	unsigned kc_nfree;
+	void *kc_free[KMEM_CACHE_MAXFREE];
+	unsigned kc_nalloc;		/* objects currently handed out */
+	unsigned kc_hits;		/* allocs served from kc_free */
+	unsigned kc_misses;		/* allocs that ran the ctor */
+
+	struct kmem_cache *kc_next;	/* list of all caches, for stats */
+	bool kc_listed;			/* true if on that list */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, maxfree, ctor, dtor) \
+	{ name, size, maxfree, ctor, dtor, SPINLOCK_INITIALIZER, \
+	  0, { NULL }, 0, 0, 0, NULL, false }
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     unsigned maxfree,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+/* Print usage info for all caches that have been used. */
+void kmem_printstats(void);
+
+#endif /* _KMEM_H_ */
@@ -48,11 +48,35 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking:
+ *
+ * sv_lock protects the in-memory inode (sv_i and sv_dirty) and the
+ * file's data and, for the directory, its entries. sfs_vnlock
+ * protects the table of loaded vnodes. sfs_freemaplock protects the
+ * free block map, its free counts and allocation hint, and the
+ * superblock. The order is: directory sv_lock,
+ * then sfs_vnlock, then file sv_lock, then sfs_freemaplock. The
+ * buffer cache has its own lock, which comes after all of these.
+ *
+ * sv_ino and the type in sv_i never change while the vnode is loaded
+ * and may be read without locking.
+ *
+ * sv_reclaiming is protected by sfs_vnlock. It is set while the last
+ * reference is being dropped (see sfs_reclaim), which writes the inode
+ * out, and maybe frees the file's blocks, without holding sfs_vnlock.
+ * Meanwhile sfs_loadvnode waits on sfs_vncv rather than hand the
+ * vnode out again.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* lock for sv_i and file data */
+	struct sfs_vnode *sv_hashnext;  /* next on sfs_vnhash chain */
+	bool sv_reclaiming;             /* true while being reclaimed */
 };
 
 struct sfs_fs {
@@ -60,11 +84,27 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct cv *sfs_vncv;            /* signalled when reclaim is done */
+	struct sfs_vnode **sfs_vnhash;  /* loaded vnodes, hashed by ino */
+	unsigned sfs_vnhashsize;        /* number of chains (power of 2) */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t sfs_freeblocks;        /* number of free blocks */
+	uint32_t *sfs_groupfree;        /* free blocks in each group */
+	uint32_t sfs_allochint;         /* next place to allocate from */
 };
 
+/*
+ * For allocation the disk is divided into groups of SFS_GROUPBLOCKS
+ * blocks (one freemap block's worth), each with a count of its free
+ * blocks in sfs_groupfree.
+ */
+#define SFS_GROUPBLOCKS		SFS_BLOCKBITS
+#define SFS_NGROUPS(nblocks)	DIVROUNDUP(nblocks, SFS_GROUPBLOCKS)
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
@@ -75,15 +115,17 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/* Convenience functions for whole-block I/O through the buffer cache */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Write an in-memory inode back to the buffer cache */
+int sfs_sync_inode(struct sfs_vnode *sv);
+
+/* Table of loaded vnodes */
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_destroy(struct sfs_fs *sfs);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
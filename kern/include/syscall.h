@@ -93,4 +93,10 @@ int sys_fstat(int fd, userptr_t statptr);
 
 /* END A4 SETUP */
 
+/* VM system calls (not available with dumbvm) */
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+
 #endif /* _SYSCALL_H_ */
@@ -184,13 +184,4 @@ int vfs_unmountall(void);
 DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
-/*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
- */
-void vfs_biglock_acquire(void);
-void vfs_biglock_release(void);
-bool vfs_biglock_do_i_hold(void);
-
-
 #endif /* _VFS_H_ */
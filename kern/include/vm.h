@@ -68,6 +68,17 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Called when a file is written or truncated, so programs exec'd from
+ * it later don't share pages read in from the old contents.
+ */
+#if OPT_DUMBVM
+#define vm_text_invalidate(v) ((void)(v))
+#else
+struct vnode;
+void vm_text_invalidate(struct vnode *v);
+#endif
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 
@@ -44,6 +44,9 @@
 #include <array.h>
 #include <spinlock.h>
 struct addrspace;
+struct vnode;
+struct lock;
+struct vm_object;
 
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
@@ -54,7 +57,9 @@ struct addrspace;
  * to hold process-specific virtual-to-physical mappings.
  *
  * The set of vm_objects contained in each addrspace is loosely
- * equivalent to a sparse page-table.
+ * equivalent to a sparse page-table. Each addrspace also has a real
+ * (two-level) page table of lpage pointers that caches lookups in
+ * the vm_objects so page faults can skip searching them.
  */
 
 ////////////////////////////////////////////////////////////
@@ -74,28 +79,58 @@ struct addrspace;
  * to hold flags.
  *
  *     LPF_DIRTY    is set if the page has been modified.
- *     LPF_PINNED   is set if the page is in transit to/from disk.
+ *     LPF_BUSY     is set while the page is being read in from swap.
+ *                  (lp_paddr is then otherwise INVALID_PADDR.) Anyone
+ *                  else who wants the page waits for it to clear.
+ *
+ * Pages being written out are protected instead by being pinned in
+ * the coremap; see lpage_evict.
  *
  * A vm_object contains an array of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
  *
- * It is assumed in the solution set VM that lpages are never shared
- * between processes.
+ * At fork time lpages are shared copy-on-write between the parent and
+ * child rather than copied. lp_refcount counts the vm_object slots
+ * that point at the lpage; while it is greater than one the page is
+ * only ever mapped read-only, and the first write fault through any
+ * of the slots gives that slot its own copy (see lpage_unshare).
+ *
+ * Swap accounting: each lpage holds one swap reservation per
+ * reference, so that every sharer can later be given its own copy.
+ * A swap page is only allocated, against one of those reservations,
+ * when the page is first evicted; until then lp_swapaddr is
+ * INVALID_SWAPADDR and the page is dirty.
+ *
+ * An unshared lpage may also know which vm_object slot it lives in
+ * (lp_obj and lp_objindex), so that when it's written out its dirty
+ * neighbours in the object can go to swap in the same I/O, in the
+ * following swap pages (see lpage_evict). This is only a hint: it's
+ * set at fault time and cleared when the page becomes shared.
+ *
+ * lp_modified is set by every write fault on the page. Unlike
+ * LPF_DIRTY it isn't cleared when the page goes out to swap, so it
+ * says whether the page has changed since it was created (for a
+ * file-backed page, since it was read from the file). Shared file
+ * mappings write back only the pages that have it set.
  */
 
 struct lpage {
 	volatile paddr_t lp_paddr;
 	off_t lp_swapaddr;
+	unsigned lp_refcount;
+	struct vm_object *lp_obj;
+	unsigned lp_objindex;
+	bool lp_modified;
 	struct spinlock lp_spinlock;
 };
 
 /* lpage flags */
 #define LPF_DIRTY		0x1
-#define LPF_PINNED		0x2
+#define LPF_BUSY		0x2
 #define LPF_MASK		0x3	// mask for the above
 
 #define LP_ISDIRTY(lp)		((lp)->lp_paddr & LPF_DIRTY)
-#define LP_ISPINNED(lp)		((lp)->lp_paddr & LPF_PINNED)
+#define LP_ISBUSY(lp)		((lp)->lp_paddr & LPF_BUSY)
 
 #define LP_SET(lp, bit)		((lp)->lp_paddr |= (bit))
 #define LP_CLEAR(lp, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit))
@@ -103,16 +138,23 @@ struct lpage {
 /*
  * Functions in lpage.c
  *
+ *    lpage_bootstrap - initialize at boot
  *    lpage_create - create a blank, non-materialized lpage structure.
- *    lpage_destroy - destroy an lpage
+ *    lpage_destroy - drop a reference to an lpage; destroy it if last
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
  *
  *    lpage_copy - clone an lpage, including the contents
+ *    lpage_share - add a copy-on-write reference to an lpage
+ *    lpage_setowner - record the vm_object slot of an unshared lpage
+ *    lpage_unshare - get a private copy of a possibly shared lpage
  *    lpage_zerofill - materialize an lpage and zero-fill it
+ *    lpage_filefill - materialize an lpage and read it from a file
+ *    lpage_writefile - write (part of) an lpage to a file
  *    lpage_fault - handle a fault on an lpage
  *    lpage_evict - evict an lpage
  */
+void              lpage_bootstrap(void);
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
@@ -120,7 +162,15 @@ void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
 
 int	              lpage_copy(struct lpage *from, struct lpage **toret);
+void              lpage_share(struct lpage *lp);
+void              lpage_setowner(struct lpage *lp, struct vm_object *vmo,
+				 unsigned index);
+int               lpage_unshare(struct lpage *lp, struct lpage **lpret);
 int               lpage_zerofill(struct lpage **lpret);
+int               lpage_filefill(struct vnode *v, off_t offset, size_t len,
+				 size_t pageoff, struct lpage **lpret);
+int               lpage_writefile(struct lpage *lp, struct vnode *v,
+				  off_t offset, size_t len, size_t pageoff);
 int               lpage_fault(struct lpage *lp, struct addrspace *,
 			                  int faulttype, vaddr_t va);
 void              lpage_evict(struct lpage *victim);
@@ -140,33 +190,123 @@ DECLARRAY_BYTYPE(lpage_array, struct lpage);
  * also allows a redzone on the lower end in which other vm_objects are
  * not allowed to fall. This is used to implement a guard band under the
  * stack.
+ *
+ * A vm_object may be backed by a file (an executable segment): then
+ * the bytes from vmo_filestart up to vmo_fileend come from the file,
+ * starting at vmo_fileoffset, and a NULL lpage means "not read in
+ * yet" rather than "zero". The rest of the object is still zerofill.
+ * Pages are read in on first fault and are ordinary anonymous lpages
+ * from then on.
+ *
+ * Read-only file-backed objects also point at a shared text object
+ * (vmo_text) for the same file and segment. Its pages are read in
+ * once and shared copy-on-write into every object that refers to it.
+ * Text objects live in a table in vmobj.c and are reference counted
+ * (vmo_refcount), which is only used in text objects.
+ *
+ * vmo_lock protects the lpage array against the pageout code, which
+ * looks at the neighbours of pages it writes out. The owning thread
+ * holds it while resizing the array or taking lpages out of it, but
+ * not for filling in an empty slot, which is one pointer store and
+ * can't invalidate anything the pageout code is looking at. In text
+ * objects it also serializes reading pages in.
+ *
+ * vm_objects made by mmap are marked with vmo_ismmap, so munmap can
+ * tell them from the program's own regions. If the mapping isn't
+ * writable vmo_writeable is clear and write faults on it fail; it's
+ * set in every other object. Shared writable mappings also have
+ * vmo_writeback set: when the object goes away (munmap or exit) the
+ * pages that were written (see lp_modified) are written back to the
+ * file. In between, evicted pages go to swap like any others.
+ *
+ * Each mapping has its own lpages, separate from the buffer cache and
+ * from other mappings of the same file, so stores through a mapping
+ * aren't seen by read() or by other processes until writeback, and
+ * writeback replaces whole pages, overwriting any write() to them
+ * since they were read in.
+ *
+ * Shared mappings are not inherited as such across fork: the child's
+ * copy has vmo_writeback clear, so it behaves as a private mapping
+ * and only the parent's changes reach the file.
  */
 struct vm_object {
 	struct lpage_array *vmo_lpages;
 	vaddr_t vmo_base;
 	size_t vmo_lower_redzone;
+
+	struct vnode *vmo_vnode;
+	off_t vmo_fileoffset;
+	vaddr_t vmo_filestart;
+	vaddr_t vmo_fileend;
+	struct vm_object *vmo_text;
+
+	unsigned vmo_refcount;
+	struct lock *vmo_lock;
+
+	bool vmo_ismmap;
+	bool vmo_writeable;
+	bool vmo_writeback;
 };
 
 /*
  * vm_object operations in vmobj.c:
  * 
+ * vm_object_bootstrap: initialize at boot.
  * vm_object_create:  allocates a blank vm_object with the requested
  *                    number of struct lpage's set for zero-fill.
- * vm_object_copy:    clone a vm_object, as at fork time.
+ * vm_object_copy:    clone a vm_object, as at fork time. The pages
+ *                    are shared copy-on-write, not copied, and the
+ *                    clone never writes back to a file.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
- * vm_object_destroy: frees all the mapping entries and swap space.
+ * vm_object_setfile: back (part of) a vm_object with a file.
+ * vm_object_filefill: materialize a page of a file-backed vm_object.
+ * vm_object_iszero:  true if a page not yet materialized is all zeros.
+ * vm_object_destroy: frees all the mapping entries and swap space,
+ *                    after writing back a shared file mapping.
  *
  */
+void                vm_object_bootstrap(void);
 struct vm_object 	*vm_object_create(size_t npages);
 int			        vm_object_copy(struct vm_object *vmo,
-					               struct addrspace *newas,
 					               struct vm_object **newvmo_ret);
 int                 vm_object_setsize(struct addrspace *as,
 					                  struct vm_object *vmo,
 					                  unsigned newnpages);
+int                 vm_object_setfile(struct vm_object *vmo,
+					  struct vnode *v, off_t offset,
+					  vaddr_t vaddr, size_t filesize,
+					  bool shared);
+int                 vm_object_filefill(struct vm_object *vmo,
+					   unsigned index,
+					   struct lpage **lpret);
+bool                vm_object_iszero(const struct vm_object *vmo,
+					 unsigned index);
 void 			 vm_object_destroy(struct addrspace *as, 
 					               struct vm_object *vmo);
 
+////////////////////////////////////////////////////////////
+//
+// pagetable - per-address-space lookup table of lpages
+//
+
+struct pagetable; /* Opaque. */
+
+/*
+ * Page table operations in pagetable.c:
+ *
+ * pagetable_create:  allocates an empty page table.
+ * pagetable_destroy: frees a page table (but not the lpages in it).
+ * pagetable_lookup:  returns the lpage cached for a virtual address,
+ *                    or NULL if there isn't one.
+ * pagetable_set:     caches (or, with NULL, drops) the lpage for a
+ *                    virtual address. May silently fail to cache.
+ */
+struct pagetable *pagetable_create(void);
+void              pagetable_destroy(struct pagetable *pt);
+struct lpage     *pagetable_lookup(struct pagetable *pt, vaddr_t va);
+void              pagetable_set(struct pagetable *pt, vaddr_t va,
+				struct lpage *lp);
+
 ////////////////////////////////////////////////////////////
 //
 // swap
@@ -181,29 +321,47 @@ void 			 vm_object_destroy(struct addrspace *as,
  * swap_shutdown:    closes the swapfile vnode. Declared in vm.h.
  * 
  * swap_alloc:       finds a free swap page and marks it as used.
- *                   A page should have been previously reserved.
+ *                   A page should have been previously reserved;
+ *                   this is done lazily, at first pageout.
+ *
+ * swap_alloc_run:   allocates between 1 and MAXPAGES contiguous swap
+ *                   pages, for writing out a cluster.
  *
  * swap_free:        unmarks a swap page.
  *
- * swap_reserve:     reserve some swap pages for future allocation.
+ * swap_reserve:     commit swap for some pages of virtual memory.
+ *                   Fails with ENOMEM past the commit limit (the
+ *                   size of the swapfile).
  *
  * swap_unreserve:   release some previously-reserved swap pages.
  *
- * swap_pagein:      Reads a page from the requested swap address 
- *                   into the requested physical page.
+ * swap_printstats:  print swap usage; called by vm_printstats.
+ *
+ * swap_pagein:      Reads pages from consecutive swap addresses
+ *                   starting at the requested one into the requested
+ *                   physical pages, in one I/O.
  *
- * swap_pageout:     Writes a page to the requested swap address 
- *                   from the requested physical page.
+ * swap_pageout:     Writes pages to consecutive swap addresses
+ *                   starting at the requested one from the requested
+ *                   physical pages, in one I/O.
+ *
+ * At most SWAP_CLUSTER pages go in one I/O.
  */
 
 off_t	 	swap_alloc(void);
+off_t		swap_alloc_run(unsigned maxpages, unsigned *npages);
 void 		swap_free(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
 void		swap_unreserve(unsigned long npages);
+void		swap_printstats(void);
+
+void 		swap_pagein(const paddr_t *paddrs, unsigned npages,
+			    off_t swapaddr);
+void 		swap_pageout(const paddr_t *paddrs, unsigned npages,
+			     off_t swapaddr);
 
-void 		swap_pagein(paddr_t paddr, off_t swapaddr);
-void 		swap_pageout(paddr_t paddr, off_t swapaddr);
+#define SWAP_CLUSTER	8	/* max pages per swap I/O */
 
 /*
  * Special disk address:
@@ -211,13 +369,6 @@ void 		swap_pageout(paddr_t paddr, off_t swapaddr);
  */
 #define INVALID_SWAPADDR	(0)
 
-/*
- * Global lock for paging. Only one page can be in transit at a time
- * (at least under current circumstances) so we get this at a fairly
- * high level to try to improve paging decisions.
- */
-extern struct lock *global_paging_lock;
-
 ////////////////////////////////////////////////////////////
 //
 // other bits
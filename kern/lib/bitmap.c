@@ -131,6 +131,36 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         *mask = ((WORD_TYPE)1) << offset;
 }
 
+/*
+ * Whole words that are full are skipped without looking at each bit.
+ */
+int
+bitmap_findfree(struct bitmap *b, unsigned start, unsigned end,
+                unsigned *index)
+{
+        unsigned i, ix;
+        WORD_TYPE mask;
+
+        KASSERT(start <= end);
+        KASSERT(end <= b->nbits);
+
+        i = start;
+        while (i < end) {
+                if (i % BITS_PER_WORD == 0 && end - i >= BITS_PER_WORD &&
+                    b->v[i / BITS_PER_WORD] == WORD_ALLBITS) {
+                        i += BITS_PER_WORD;
+                        continue;
+                }
+                bitmap_translate(i, &ix, &mask);
+                if ((b->v[ix] & mask)==0) {
+                        *index = i;
+                        return 0;
+                }
+                i++;
+        }
+        return ENOSPC;
+}
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
@@ -44,6 +44,8 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
+#include <dcache.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
@@ -111,6 +113,8 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	buffer_bootstrap();
+	dcache_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
@@ -38,6 +38,9 @@
 #include <clock.h>
 #include <thread.h>
 #include <vfs.h>
+#include <buf.h>
+#include <dcache.h>
+#include <kmem.h>
 #include <syscall.h>
 #include <test.h>
 #include <pid.h>
@@ -549,6 +552,42 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_dcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	dcache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_kmemstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_threadstats(int nargs, char **args)
@@ -662,6 +701,9 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[bc] Buffer cache stats             ",
+	"[dc] Name cache stats               ",
+	"[kc] Object cache stats             ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -710,6 +752,9 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "bc",         cmd_bufstats },
+	{ "dc",         cmd_dcachestats },
+	{ "kc",         cmd_kmemstats },
 	{ "ts", 		cmd_threadstats  },
 
 	/* base system tests */
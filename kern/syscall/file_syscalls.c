@@ -14,6 +14,7 @@
 #include <syscall.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 #include <uio.h>
 #include <kern/fcntl.h>
 #include <kern/unistd.h>
@@ -223,6 +224,7 @@ sys_write(int fd, userptr_t buf, size_t len, int *retval)
         mk_useruio(&user_iov, &user_uio, buf, len, curthread->t_filetable[fd]->offsets, UIO_WRITE);
 
         /* does the write */
+        vm_text_invalidate(curthread->t_filetable[fd]->vnodes);
         result = VOP_WRITE(curthread->t_filetable[fd]->vnodes, &user_uio);
         if (result) {
             lock_release(curthread->t_filetable[fd]->ftlock);
@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Outside of dumbvm, the segments aren't actually loaded: each one is
+ * attached to its region with as_define_file and paged in from the
+ * executable on demand.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -64,6 +65,7 @@
 #include "opt-dumbvm.h"
 /* END A4 SETUP */
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -147,6 +149,7 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -303,9 +306,16 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = as_define_file(curthread->t_addrspace, v,
+					ph.p_offset, ph.p_vaddr,
+					ph.p_memsz, ph.p_filesz,
+					ph.p_flags & PF_W);
+#endif
 		if (result) {
 			return result;
 		}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/limits.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <file.h>
+#include <syscall.h>
+
+/*
+ * VM system calls. These need the real VM system, so this file is not
+ * compiled with dumbvm.
+ */
+
+/*
+ * sys_sbrk: move the end of the heap by AMOUNT bytes, which may be
+ * negative, and return the old end.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	vaddr_t oldbreak;
+	int result;
+
+	result = as_sbrk(curthread->t_addrspace, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/*
+ * sys_mmap: map LEN bytes of the file open on FD, from OFFSET on, and
+ * return the address of the mapping. ADDR is only a hint, which we
+ * ignore; MAP_FIXED isn't supported.
+ *
+ * The file must be open for reading, and for writing too if changes
+ * are to go back to it (MAP_SHARED with PROT_WRITE). The file system
+ * gets a say through VOP_MMAP.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int32_t *retval)
+{
+	struct filetable *ft;
+	int shared, writeable, accmode;
+	vaddr_t va;
+	int result;
+
+	(void)addr;
+
+	switch (flags & (MAP_SHARED | MAP_PRIVATE)) {
+	    case MAP_SHARED: shared = 1; break;
+	    case MAP_PRIVATE: shared = 0; break;
+	    default: return EINVAL;
+	}
+	if (flags & ~(MAP_SHARED | MAP_PRIVATE)) {
+		/* including MAP_FIXED */
+		return EINVAL;
+	}
+	writeable = (prot & PROT_WRITE) != 0;
+
+	if (fd < 0 || fd >= __OPEN_MAX) {
+		return EBADF;
+	}
+	ft = curthread->t_filetable[fd];
+	if (ft == NULL || ft->vnodes == NULL) {
+		return EBADF;
+	}
+	accmode = ft->flags & O_ACCMODE;
+	if (accmode == O_WRONLY) {
+		return EACCES;
+	}
+	if (shared && writeable && accmode != O_RDWR) {
+		return EACCES;
+	}
+
+	result = VOP_MMAP(ft->vnodes);
+	if (result) {
+		return result;
+	}
+
+	result = as_mmap(curthread->t_addrspace, ft->vnodes, offset, len,
+			 writeable, shared, &va);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)va;
+	return 0;
+}
+
+/*
+ * sys_munmap: remove a mapping made with mmap.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	return as_munmap(curthread->t_addrspace, (vaddr_t)addr, len);
+}
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -40,7 +41,8 @@ bitmaptest(int nargs, char **args)
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
-	int i;
+	unsigned start, end, want;
+	int i, j;
 
 	(void)nargs;
 	(void)args;
@@ -89,6 +91,19 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	for (j=0; j<100; j++) {
+		start = random() % TESTSIZE;
+		end = start + random() % (TESTSIZE - start + 1);
+		for (want = start; want < end && !data[want]; want++);
+		if (want < end) {
+			KASSERT(bitmap_findfree(b, start, end, &x)==0);
+			KASSERT(x == want);
+		}
+		else {
+			KASSERT(bitmap_findfree(b, start, end, &x)==ENOSPC);
+		}
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
@@ -33,7 +33,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <kmem.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
@@ -147,31 +149,60 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks come from an object cache, so the wait channel and spinlock
+ * are set up once per object rather than once per lock_create. The
+ * cache is statically initialized because locks are created very
+ * early in boot.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	lock->lk_name = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       KMEM_CACHE_MAXFREE, lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
+	wchan_setname(lock->lk_wchan, lock->lk_name);
 
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;
-        
+	KASSERT(lock->lk_holder == NULL);
         return lock;
 }
 
@@ -181,11 +212,11 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
-        
+	wchan_setname(lock->lk_wchan, "lock");
+
         kfree(lock->lk_name);
-        kfree(lock);
+        lock->lk_name = NULL;
+        kmem_cache_free(&lock_cache, lock);
 }
 
 void
@@ -208,6 +239,28 @@ lock_acquire(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+/*
+ * lock_tryacquire: get the lock if nobody (including us) holds it;
+ * never sleeps. For callers that would otherwise risk deadlock by
+ * waiting.
+ */
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool ret;
+
+	DEBUGASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_lock);
+	ret = (lock->lk_holder == NULL);
+	if (ret) {
+		lock->lk_holder = curthread;
+	}
+	spinlock_release(&lock->lk_lock);
+
+	return ret;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -39,6 +39,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <kmem.h>
 #include <thread.h>
 #include <threadlist.h>
 #include <threadprivate.h>
@@ -119,9 +120,46 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Thread structures come from an object cache. A cached thread keeps
+ * its kernel stack (if it had one), so thread_fork doesn't have to
+ * allocate a fresh stack page each time. Because of the stacks, keep
+ * the free list fairly short.
+ */
+#define THREAD_CACHE_MAXFREE	8
+
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       THREAD_CACHE_MAXFREE, thread_ctor, thread_dtor);
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * Note that t_stack may already be set if the structure is recycled.
  */
 static
 struct thread *
@@ -131,14 +169,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -146,8 +184,6 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 
@@ -222,6 +258,8 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	kmalloc_cpu_init(c);
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -234,16 +272,22 @@ cpu_create(unsigned hardware_number)
 		 * cpu. This means we're using the boot stack, which
 		 * can't be freed. (Exercise: what would it take to
 		 * make it possible to free the boot stack?)
+		 *
+		 * This is the very first thread, so it can't have come
+		 * off the thread cache with a stack attached.
 		 */
 		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 
 		/* Also, set the initial process ID - New for ASST2. */
 		c->c_curthread->t_pid = BOOTUP_PID;
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
-			panic("cpu_create: couldn't allocate stack");
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+			if (c->c_curthread->t_stack == NULL) {
+				panic("cpu_create: couldn't allocate stack");
+			}
 		}
 		thread_checkstack_init(c->c_curthread);
 
@@ -287,18 +331,15 @@ thread_destroy(struct thread *thread)
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
 
-	/* Thread subsystem fields */
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	/* Thread subsystem fields; the stack stays with the structure */
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	thread->t_name = NULL;
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -778,11 +819,13 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless the structure came with one */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -1128,6 +1171,17 @@ wchan_destroy(struct wchan *wc)
 	kfree(wc);
 }
 
+/*
+ * Rename a wait channel.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	spinlock_acquire(&wc->wc_lock);
+	wc->wc_name = name;
+	spinlock_release(&wc->wc_lock);
+}
+
 /*
  * Lock and unlock a wait channel, respectively.
  */
@@ -1300,7 +1354,7 @@ ipi_broadcast(int code)
 }
 
 void
-ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
+ipi_tlbshootdown_queue(unsigned targetcpu, const struct tlbshootdown *mapping)
 {
         int n;
         struct cpu *target;
@@ -1310,7 +1364,10 @@ ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
         spinlock_acquire(&target->c_ipi_lock);
 
         n = target->c_numshootdown;
-        if (n == TLBSHOOTDOWN_MAX) {
+        if (n == TLBSHOOTDOWN_ALL) {
+                /* already flushing everything */
+        }
+        else if (n == TLBSHOOTDOWN_MAX) {
                 target->c_numshootdown = TLBSHOOTDOWN_ALL;
         }
         else {
@@ -1319,11 +1376,31 @@ ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
         }
 
         target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-        mainbus_send_ipi(target);
 
         spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_send(unsigned targetcpu)
+{
+        struct cpu *target;
+
+        target = cpuarray_get(&allcpus, targetcpu);
+
+        spinlock_acquire(&target->c_ipi_lock);
+        if (target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) {
+                mainbus_send_ipi(target);
+        }
+        spinlock_release(&target->c_ipi_lock);
+}
+
+void
+ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
+{
+        ipi_tlbshootdown_queue(targetcpu, mapping);
+        ipi_tlbshootdown_send(targetcpu);
+}
+
 void
 interprocessor_interrupt(void)
 {
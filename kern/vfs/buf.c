@@ -0,0 +1,633 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache.
+ *
+ * There is a fixed pool of NBUFS buffers, each BUFFER_SIZE bytes,
+ * allocated at boot. A buffer in use holds the contents of one block
+ * of one device; it is on a hash chain (keyed by device and block
+ * number) so it can be found quickly, and on the LRU list so the
+ * least recently used one can be picked when a new block has to be
+ * brought in. Unused buffers sit at the front of the LRU list so
+ * they are picked first.
+ *
+ * All of the shared state is protected by buffer_lock. A buffer that
+ * is being used by some thread, or that is undergoing I/O, is marked
+ * busy; only the thread that set b_busy may touch the buffer's data
+ * or b_valid/b_dirty, and it may do so without holding buffer_lock.
+ * Anyone wanting a busy buffer waits on buffer_cv. buffer_lock is not
+ * held across disk I/O.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <device.h>
+#include <buf.h>
+
+/* Number of buffers, and number of hash chains. */
+#define NBUFS		128
+#define NBUCKETS	61
+
+struct buf {
+	struct buf *b_hashnext;		/* next buffer on hash chain */
+	struct buf *b_lruprev;		/* LRU list; head is least recent */
+	struct buf *b_lrunext;
+	struct device *b_dev;		/* device, or NULL if not in use */
+	daddr_t b_block;		/* block number on b_dev */
+	void *b_data;			/* BUFFER_SIZE bytes of block data */
+	bool b_valid;			/* b_data holds the block contents */
+	bool b_dirty;			/* b_data needs to be written back */
+	bool b_busy;			/* in use by some thread */
+};
+
+static struct buf *buffers;
+static struct buf *buffer_hash[NBUCKETS];
+static struct buf *lru_head, *lru_tail;
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+
+/* Statistics; protected by buffer_lock. */
+static uint32_t bs_hits;		/* found valid in the cache */
+static uint32_t bs_misses;		/* not found, or found invalid */
+static uint32_t bs_reads;		/* blocks read from disk */
+static uint32_t bs_evictwrites;		/* dirty blocks written on eviction */
+static uint32_t bs_syncwrites;		/* dirty blocks written by sync */
+
+////////////////////////////////////////////////////////////
+//
+// Hash chains and LRU list
+
+static
+unsigned
+buffer_hashfunc(struct device *dev, daddr_t block)
+{
+	return (dev->d_devnumber * 131 + block) % NBUCKETS;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	b = buffer_hash[buffer_hashfunc(dev, block)];
+	while (b != NULL) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+		b = b->b_hashnext;
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hash_insert(struct buf *b)
+{
+	unsigned ix;
+
+	KASSERT(b->b_dev != NULL);
+
+	ix = buffer_hashfunc(b->b_dev, b->b_block);
+	b->b_hashnext = buffer_hash[ix];
+	buffer_hash[ix] = b;
+}
+
+static
+void
+buffer_hash_remove(struct buf *b)
+{
+	struct buf **bp;
+
+	KASSERT(b->b_dev != NULL);
+
+	bp = &buffer_hash[buffer_hashfunc(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		lru_head = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		lru_tail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B at the most-recently-used end of the LRU list. */
+static
+void
+lru_append(struct buf *b)
+{
+	b->b_lruprev = lru_tail;
+	b->b_lrunext = NULL;
+	if (lru_tail != NULL) {
+		lru_tail->b_lrunext = b;
+	}
+	else {
+		lru_head = b;
+	}
+	lru_tail = b;
+}
+
+/* Put B at the least-recently-used end of the LRU list. */
+static
+void
+lru_prepend(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = lru_head;
+	if (lru_head != NULL) {
+		lru_head->b_lruprev = b;
+	}
+	else {
+		lru_tail = b;
+	}
+	lru_head = b;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Disk I/O
+
+/*
+ * Read or write a buffer. The buffer must be busy, and buffer_lock
+ * must not be held.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries=0;
+
+	KASSERT(b->b_busy);
+	KASSERT(!lock_do_i_hold(buffer_lock));
+
+	DEBUG(DB_VFS, "buffer: %s block %u\n",
+	      rw == UIO_READ ? "read" : "write", b->b_block);
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+		  ((off_t)b->b_block)*BUFFER_SIZE, rw);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buffer: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation
+
+/*
+ * Find a buffer to reuse: the least recently used one that isn't busy.
+ * If it's dirty, write it back first, which drops buffer_lock for the
+ * duration; the caller must therefore recheck the cache afterwards.
+ * Hands back the buffer busy, clean, and off the hash chains.
+ */
+static
+int
+buffer_evict(struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	while (1) {
+		for (b = lru_head; b != NULL; b = b->b_lrunext) {
+			if (!b->b_busy) {
+				break;
+			}
+		}
+		if (b != NULL) {
+			break;
+		}
+		/* Everything's in use; wait for something to come free. */
+		cv_wait(buffer_cv, buffer_lock);
+	}
+
+	b->b_busy = true;
+
+	if (b->b_dirty) {
+		KASSERT(b->b_valid);
+		lock_release(buffer_lock);
+		result = buffer_io(b, UIO_WRITE);
+		lock_acquire(buffer_lock);
+		if (result) {
+			b->b_busy = false;
+			cv_broadcast(buffer_cv, buffer_lock);
+			return result;
+		}
+		b->b_dirty = false;
+		bs_evictwrites++;
+	}
+
+	if (b->b_dev != NULL) {
+		buffer_hash_remove(b);
+		b->b_dev = NULL;
+	}
+	b->b_valid = false;
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Return a buffer that has no identity to the free end of the LRU
+ * list and wake up anyone waiting for it.
+ */
+static
+void
+buffer_discard(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+	KASSERT(!b->b_dirty);
+
+	if (b->b_dev != NULL) {
+		buffer_hash_remove(b);
+		b->b_dev = NULL;
+	}
+	b->b_valid = false;
+	lru_remove(b);
+	lru_prepend(b);
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+/*
+ * Common code for buffer_read and buffer_get.
+ */
+static
+int
+buffer_acquire(struct device *dev, daddr_t block, bool doread,
+	       struct buf **ret)
+{
+	struct buf *b, *newb;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+	KASSERT(block < dev->d_blocks);
+
+	lock_acquire(buffer_lock);
+
+	while (1) {
+		b = buffer_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			b->b_busy = true;
+			if (b->b_valid) {
+				bs_hits++;
+			}
+			else {
+				bs_misses++;
+			}
+			break;
+		}
+
+		result = buffer_evict(&newb);
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+
+		/* Someone may have brought the block in while we slept. */
+		if (buffer_find(dev, block) != NULL) {
+			buffer_discard(newb);
+			continue;
+		}
+
+		b = newb;
+		b->b_dev = dev;
+		b->b_block = block;
+		buffer_hash_insert(b);
+		bs_misses++;
+		break;
+	}
+
+	if (doread && !b->b_valid) {
+		lock_release(buffer_lock);
+		result = buffer_io(b, UIO_READ);
+		lock_acquire(buffer_lock);
+		if (result) {
+			buffer_discard(b);
+			lock_release(buffer_lock);
+			return result;
+		}
+		b->b_valid = true;
+		bs_reads++;
+	}
+
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Public interface
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_acquire(dev, block, true, ret);
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_acquire(dev, block, false, ret);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dev != NULL);
+
+	if (!b->b_valid) {
+		/* Gotten with buffer_get and never filled in. */
+		buffer_discard(b);
+	}
+	else {
+		lru_remove(b);
+		lru_append(b);
+		b->b_busy = false;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+
+	lock_release(buffer_lock);
+}
+
+/*
+ * Give back a buffer whose contents a failed copy left neither the
+ * old data nor the new. If it's clean, drop it, so the next use reads
+ * the block from disk again. If it already held changes that weren't
+ * written yet, those can't be told apart from the partial copy any
+ * more, so it stays dirty, as after any other partial write.
+ */
+void
+buffer_abandon(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dev != NULL);
+
+	if (b->b_dirty) {
+		lock_release(buffer_lock);
+		buffer_release(b);
+		return;
+	}
+	buffer_discard(b);
+
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write back every dirty buffer belonging to DEV. Buffers that are in
+ * use are waited for, so everything that was dirty when we started has
+ * been written when we return successfully.
+ */
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(buffer_lock);
+
+	i = 0;
+	while (i < NBUFS) {
+		b = &buffers[i];
+		if (b->b_dev != dev || !b->b_dirty) {
+			i++;
+			continue;
+		}
+		if (b->b_busy) {
+			/* Wait, then look at this buffer again. */
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+
+		b->b_busy = true;
+		lock_release(buffer_lock);
+		result = buffer_io(b, UIO_WRITE);
+		lock_acquire(buffer_lock);
+		if (result == 0) {
+			b->b_dirty = false;
+			bs_syncwrites++;
+		}
+		b->b_busy = false;
+		cv_broadcast(buffer_cv, buffer_lock);
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+		i++;
+	}
+
+	lock_release(buffer_lock);
+	return 0;
+}
+
+/*
+ * Forget every buffer belonging to DEV. This is for unmount (after a
+ * sync) and failed mounts; nothing may be using the device's buffers
+ * and none of them may be dirty.
+ */
+void
+buffer_drop(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<NBUFS; i++) {
+		b = &buffers[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_dirty);
+		b->b_busy = true;
+		buffer_discard(b);
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	uint32_t hits, misses, reads, ewrites, swrites;
+	unsigned i, used, dirty;
+
+	lock_acquire(buffer_lock);
+	hits = bs_hits;
+	misses = bs_misses;
+	reads = bs_reads;
+	ewrites = bs_evictwrites;
+	swrites = bs_syncwrites;
+	used = dirty = 0;
+	for (i=0; i<NBUFS; i++) {
+		if (buffers[i].b_dev != NULL) {
+			used++;
+		}
+		if (buffers[i].b_dirty) {
+			dirty++;
+		}
+	}
+	lock_release(buffer_lock);
+
+	kprintf("buffer: %u of %u buffers in use, %u dirty\n",
+		used, NBUFS, dirty);
+	kprintf("buffer: %lu hits %lu misses (%lu%% hit rate)\n",
+		(unsigned long) hits, (unsigned long) misses,
+		(unsigned long) (hits + misses == 0 ? 0 :
+				 (100ULL * hits) / (hits + misses)));
+	kprintf("buffer: %lu reads %lu writes (%lu on eviction, "
+		"%lu on sync)\n",
+		(unsigned long) reads, (unsigned long) (ewrites + swrites),
+		(unsigned long) ewrites, (unsigned long) swrites);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+void
+buffer_bootstrap(void)
+{
+	unsigned i;
+
+	buffers = kmalloc(NBUFS * sizeof(struct buf));
+	if (buffers == NULL) {
+		panic("buffer: Could not allocate buffer headers\n");
+	}
+
+	for (i=0; i<NBUCKETS; i++) {
+		buffer_hash[i] = NULL;
+	}
+	lru_head = lru_tail = NULL;
+
+	for (i=0; i<NBUFS; i++) {
+		struct buf *b = &buffers[i];
+
+		b->b_data = kmalloc(BUFFER_SIZE);
+		if (b->b_data == NULL) {
+			panic("buffer: Could not allocate buffers\n");
+		}
+		b->b_hashnext = NULL;
+		b->b_dev = NULL;
+		b->b_block = 0;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_busy = false;
+		lru_append(b);
+	}
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer: Could not create lock\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer: Could not create cv\n");
+	}
+}
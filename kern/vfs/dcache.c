@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name cache.
+ *
+ * There is a fixed pool of NENTRIES entries, allocated at boot. An
+ * entry in use maps (directory, name) to a target vnode, or to NULL
+ * if the name is known not to exist; it is on a hash chain keyed by
+ * directory and name, and on the LRU list so the least recently used
+ * entry can be recycled when a new one is needed. Unused entries sit
+ * at the front of the LRU list so they are picked first.
+ *
+ * An entry in use holds a reference to its directory and (unless
+ * negative) to its target. Dropping a reference can reclaim the vnode
+ * and so cannot be done under dcache_lock; entries are detached under
+ * the lock and their references released after it is dropped. Taking
+ * a reference can, so a hit's target cannot be reclaimed before the
+ * caller gets it.
+ *
+ * Names too long for an entry are never cached; lookups on them
+ * always miss.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <dcache.h>
+
+/* Number of entries, number of hash chains, and longest name cached. */
+#define NENTRIES	128
+#define NBUCKETS	61
+#define DC_NAMELEN	64
+
+struct dcentry {
+	struct dcentry *d_hashnext;	/* next entry on hash chain */
+	struct dcentry *d_lruprev;	/* LRU list; head is least recent */
+	struct dcentry *d_lrunext;
+	struct vnode *d_dir;		/* directory, or NULL if not in use */
+	struct vnode *d_target;		/* target, or NULL if negative */
+	char d_name[DC_NAMELEN];	/* name within d_dir */
+};
+
+static struct dcentry *dcache;
+static struct dcentry *dcache_hash[NBUCKETS];
+static struct dcentry *lru_head, *lru_tail;
+
+static struct lock *dcache_lock;
+
+/*
+ * Filesystem being unmounted, if any; no entries are made for it.
+ * Unmounts are serialized by the vfs layer, so one is enough.
+ * Protected by dcache_lock.
+ */
+static struct fs *dcache_closedfs;
+
+/* Statistics; protected by dcache_lock. */
+static uint32_t ds_hits;		/* found a target */
+static uint32_t ds_neghits;		/* found a negative entry */
+static uint32_t ds_misses;		/* not found */
+static uint32_t ds_enters;		/* entries made */
+static uint32_t ds_evictions;		/* entries recycled while in use */
+static uint32_t ds_invalidations;	/* entries invalidated */
+
+////////////////////////////////////////////////////////////
+//
+// Hash chains and LRU list
+
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (unsigned)(uintptr_t)dir >> 4;
+	while (*name != 0) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h % NBUCKETS;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *e;
+
+	KASSERT(lock_do_i_hold(dcache_lock));
+
+	e = dcache_hash[dcache_hashfunc(dir, name)];
+	while (e != NULL) {
+		if (e->d_dir == dir && !strcmp(e->d_name, name)) {
+			return e;
+		}
+		e = e->d_hashnext;
+	}
+	return NULL;
+}
+
+static
+void
+dcache_hash_insert(struct dcentry *e)
+{
+	unsigned ix;
+
+	KASSERT(e->d_dir != NULL);
+
+	ix = dcache_hashfunc(e->d_dir, e->d_name);
+	e->d_hashnext = dcache_hash[ix];
+	dcache_hash[ix] = e;
+}
+
+static
+void
+dcache_hash_remove(struct dcentry *e)
+{
+	struct dcentry **ep;
+
+	KASSERT(e->d_dir != NULL);
+
+	ep = &dcache_hash[dcache_hashfunc(e->d_dir, e->d_name)];
+	while (*ep != e) {
+		KASSERT(*ep != NULL);
+		ep = &(*ep)->d_hashnext;
+	}
+	*ep = e->d_hashnext;
+	e->d_hashnext = NULL;
+}
+
+static
+void
+lru_remove(struct dcentry *e)
+{
+	if (e->d_lruprev != NULL) {
+		e->d_lruprev->d_lrunext = e->d_lrunext;
+	}
+	else {
+		lru_head = e->d_lrunext;
+	}
+	if (e->d_lrunext != NULL) {
+		e->d_lrunext->d_lruprev = e->d_lruprev;
+	}
+	else {
+		lru_tail = e->d_lruprev;
+	}
+	e->d_lruprev = e->d_lrunext = NULL;
+}
+
+/* Put E at the most-recently-used end of the LRU list. */
+static
+void
+lru_append(struct dcentry *e)
+{
+	e->d_lruprev = lru_tail;
+	e->d_lrunext = NULL;
+	if (lru_tail != NULL) {
+		lru_tail->d_lrunext = e;
+	}
+	else {
+		lru_head = e;
+	}
+	lru_tail = e;
+}
+
+/* Put E at the least-recently-used end of the LRU list. */
+static
+void
+lru_prepend(struct dcentry *e)
+{
+	e->d_lruprev = NULL;
+	e->d_lrunext = lru_head;
+	if (lru_head != NULL) {
+		lru_head->d_lruprev = e;
+	}
+	else {
+		lru_tail = e;
+	}
+	lru_head = e;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Entry management
+
+/*
+ * Take E out of use, handing back the references it held in *DIR and
+ * *TARGET. The caller drops them with dcache_putrefs once dcache_lock
+ * is released.
+ */
+static
+void
+dcache_detach(struct dcentry *e, struct vnode **dir, struct vnode **target)
+{
+	KASSERT(lock_do_i_hold(dcache_lock));
+	KASSERT(e->d_dir != NULL);
+
+	dcache_hash_remove(e);
+	lru_remove(e);
+	lru_prepend(e);
+
+	*dir = e->d_dir;
+	*target = e->d_target;
+	e->d_dir = NULL;
+	e->d_target = NULL;
+	e->d_name[0] = 0;
+}
+
+static
+void
+dcache_putrefs(struct vnode *dir, struct vnode *target)
+{
+	KASSERT(!lock_do_i_hold(dcache_lock));
+
+	if (target != NULL) {
+		VOP_DECREF(target);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *e;
+
+	if (strlen(name) >= DC_NAMELEN) {
+		return false;
+	}
+
+	lock_acquire(dcache_lock);
+	e = dcache_find(dir, name);
+	if (e == NULL) {
+		ds_misses++;
+		lock_release(dcache_lock);
+		return false;
+	}
+
+	lru_remove(e);
+	lru_append(e);
+
+	if (e->d_target != NULL) {
+		/* the entry's own reference keeps this from reclaiming */
+		VOP_INCREF(e->d_target);
+		ds_hits++;
+	}
+	else {
+		ds_neghits++;
+	}
+	*ret = e->d_target;
+	lock_release(dcache_lock);
+
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *target)
+{
+	struct dcentry *e;
+	struct vnode *olddir, *oldtarget;
+
+	if (strlen(name) >= DC_NAMELEN) {
+		return;
+	}
+
+	VOP_INCREF(dir);
+	if (target != NULL) {
+		VOP_INCREF(target);
+	}
+
+	olddir = oldtarget = NULL;
+
+	lock_acquire(dcache_lock);
+	if (dcache_closedfs != NULL && dir->vn_fs == dcache_closedfs) {
+		/* don't hold references that would keep it busy */
+		lock_release(dcache_lock);
+		dcache_putrefs(dir, target);
+		return;
+	}
+	e = dcache_find(dir, name);
+	if (e == NULL) {
+		e = lru_head;
+		KASSERT(e != NULL);
+		if (e->d_dir != NULL) {
+			ds_evictions++;
+		}
+	}
+	if (e->d_dir != NULL) {
+		dcache_detach(e, &olddir, &oldtarget);
+	}
+
+	e->d_dir = dir;
+	e->d_target = target;
+	strcpy(e->d_name, name);
+	dcache_hash_insert(e);
+	lru_remove(e);
+	lru_append(e);
+	ds_enters++;
+	lock_release(dcache_lock);
+
+	dcache_putrefs(olddir, oldtarget);
+}
+
+void
+dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcentry *e;
+	struct vnode *olddir, *oldtarget;
+
+	if (strlen(name) >= DC_NAMELEN) {
+		return;
+	}
+
+	olddir = oldtarget = NULL;
+
+	lock_acquire(dcache_lock);
+	e = dcache_find(dir, name);
+	if (e != NULL) {
+		dcache_detach(e, &olddir, &oldtarget);
+		ds_invalidations++;
+	}
+	lock_release(dcache_lock);
+
+	dcache_putrefs(olddir, oldtarget);
+}
+
+/*
+ * Drop every entry whose directory is on FS, so that the references
+ * the cache holds don't keep the filesystem busy at unmount time.
+ * Until dcache_openfs, lookups that race with the unmount can't put
+ * entries back.
+ */
+void
+dcache_closefs(struct fs *fs)
+{
+	struct dcentry *e;
+	struct vnode *olddir, *oldtarget;
+	unsigned i;
+
+	lock_acquire(dcache_lock);
+	KASSERT(dcache_closedfs == NULL);
+	dcache_closedfs = fs;
+	lock_release(dcache_lock);
+
+	for (i=0; i<NENTRIES; i++) {
+		e = &dcache[i];
+		olddir = oldtarget = NULL;
+
+		lock_acquire(dcache_lock);
+		if (e->d_dir != NULL && e->d_dir->vn_fs == fs) {
+			dcache_detach(e, &olddir, &oldtarget);
+		}
+		lock_release(dcache_lock);
+
+		dcache_putrefs(olddir, oldtarget);
+	}
+}
+
+/*
+ * Stop refusing entries on FS. Called whether or not the unmount
+ * worked; if it did, FS is gone, and the next filesystem might be
+ * given the same address.
+ */
+void
+dcache_openfs(struct fs *fs)
+{
+	lock_acquire(dcache_lock);
+	KASSERT(dcache_closedfs == fs);
+	dcache_closedfs = NULL;
+	lock_release(dcache_lock);
+}
+
+void
+dcache_printstats(void)
+{
+	uint32_t hits, neghits, misses, enters, evictions, invalidations;
+	unsigned i, used, negative;
+
+	lock_acquire(dcache_lock);
+	hits = ds_hits;
+	neghits = ds_neghits;
+	misses = ds_misses;
+	enters = ds_enters;
+	evictions = ds_evictions;
+	invalidations = ds_invalidations;
+	used = negative = 0;
+	for (i=0; i<NENTRIES; i++) {
+		if (dcache[i].d_dir != NULL) {
+			used++;
+			if (dcache[i].d_target == NULL) {
+				negative++;
+			}
+		}
+	}
+	lock_release(dcache_lock);
+
+	kprintf("dcache: %u of %u entries in use, %u negative\n",
+		used, NENTRIES, negative);
+	kprintf("dcache: %lu hits %lu negative hits %lu misses "
+		"(%lu%% hit rate)\n",
+		(unsigned long) hits, (unsigned long) neghits,
+		(unsigned long) misses,
+		(unsigned long) (hits + neghits + misses == 0 ? 0 :
+				 (100ULL * (hits + neghits)) /
+				 (hits + neghits + misses)));
+	kprintf("dcache: %lu entries made, %lu recycled, %lu invalidated\n",
+		(unsigned long) enters, (unsigned long) evictions,
+		(unsigned long) invalidations);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache = kmalloc(NENTRIES * sizeof(struct dcentry));
+	if (dcache == NULL) {
+		panic("dcache: Could not allocate name cache\n");
+	}
+
+	for (i=0; i<NBUCKETS; i++) {
+		dcache_hash[i] = NULL;
+	}
+	lru_head = lru_tail = NULL;
+
+	for (i=0; i<NENTRIES; i++) {
+		struct dcentry *e = &dcache[i];
+
+		e->d_hashnext = NULL;
+		e->d_dir = NULL;
+		e->d_target = NULL;
+		e->d_name[0] = 0;
+		lru_append(e);
+	}
+
+	dcache_lock = lock_create("name cache");
+	if (dcache_lock == NULL) {
+		panic("dcache: Could not create lock\n");
+	}
+}
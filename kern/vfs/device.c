@@ -241,15 +241,16 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mappings are paged in and out with VOP_READ and VOP_WRITE
+ * at page-sized offsets, which none of our devices need to support
+ * (and the console certainly doesn't), so devices can't be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return ENODEV;
 }
 
 /*
@@ -441,6 +442,20 @@ static const struct vnode_ops dev_vnode_ops = {
 	dev_lookparent,
 };
 
+/*
+ * Return the device behind a device vnode, or NULL if V isn't one.
+ * This is for kernel clients, such as swap, that do their own I/O
+ * on a device they opened by name.
+ */
+struct device *
+dev_fromvnode(struct vnode *v)
+{
+	if (v->vn_ops != &dev_vnode_ops) {
+		return NULL;
+	}
+	return v->vn_data;
+}
+
 /*
  * Function to create a vnode for a VFS device.
  */
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <dcache.h>
 
 /*
  * Structure for a single named device.
@@ -60,6 +61,9 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem. 
  *
+ * kd_busy    - Number of vfs_sync calls working on kd_fs without
+ *              holding knowndevs_lock. Unmount waits for it to be 0.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -80,6 +84,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	unsigned kd_busy;
 };
 
 DECLARRAY(knowndev);
@@ -87,9 +92,15 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
-static struct lock *vfs_biglock;
-static unsigned vfs_biglock_depth;
+/*
+ * Lock for the device list (and for mounting and unmounting). It only
+ * covers the names; each filesystem does its own locking for its own
+ * operations. It is never held across filesystem I/O other than
+ * mount and unmount. knowndevs_cv is signalled when a kd_busy count
+ * drops to 0.
+ */
+static struct lock *knowndevs_lock;
+static struct cv *knowndevs_cv;
 
 
 /*
@@ -103,83 +114,89 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
-	vfs_biglock = lock_create("vfs_biglock");
-	if (vfs_biglock==NULL) {
-		panic("vfs: Could not create vfs big lock\n");
-	}
-	vfs_biglock_depth = 0;
-
-	devnull_create();
-}
-
-/*
- * Operations on vfs_biglock. We make it recursive to avoid having to
- * think about where we do and don't already hold it. This is an
- * undesirable hack that's frequently necessary when a lock covers too
- * much material. Your solution scheme for FS and VFS locking should
- * not require recursive locks.
- */
-void
-vfs_biglock_acquire(void)
-{
-	if (!lock_do_i_hold(vfs_biglock)) {
-		lock_acquire(vfs_biglock);
+	knowndevs_lock = lock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
 	}
-	vfs_biglock_depth++;
-}
 
-void
-vfs_biglock_release(void)
-{
-	KASSERT(lock_do_i_hold(vfs_biglock));
-	KASSERT(vfs_biglock_depth > 0);
-	vfs_biglock_depth--;
-	if (vfs_biglock_depth == 0) {
-		lock_release(vfs_biglock);
+	knowndevs_cv = cv_create("knowndevs");
+	if (knowndevs_cv==NULL) {
+		panic("vfs: Could not create knowndevs cv\n");
 	}
-}
 
-bool
-vfs_biglock_do_i_hold(void)
-{
-	return lock_do_i_hold(vfs_biglock);
+	devnull_create();
 }
 
 /*
  * Global sync function - call FSOP_SYNC on all devices.
+ *
+ * Each filesystem is synced without knowndevs_lock, so name lookups,
+ * mounts and unmounts of other devices don't wait for the disk. We
+ * take each mounted fs pointer under the lock and mark the device
+ * busy, which keeps it from being unmounted while we sync it. Devices
+ * are never removed from the list, so it's safe to step through it
+ * by index between lock holds.
  */
 int
 vfs_sync(void)
 {
 	struct knowndev *dev;
-	unsigned i, num;
-
-	vfs_biglock_acquire();
+	struct fs *fs;
+	unsigned i;
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; i<num; i++) {
+	lock_acquire(knowndevs_lock);
+	for (i=0; i<knowndevarray_num(knowndevs); i++) {
 		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_fs != NULL) {
-			/*result =*/ FSOP_SYNC(dev->kd_fs);
+		fs = dev->kd_fs;
+		if (fs == NULL) {
+			continue;
 		}
-	}
+		dev->kd_busy++;
+		lock_release(knowndevs_lock);
 
-	vfs_biglock_release();
+		/*result =*/ FSOP_SYNC(fs);
+
+		lock_acquire(knowndevs_lock);
+		KASSERT(dev->kd_fs == fs);
+		KASSERT(dev->kd_busy > 0);
+		dev->kd_busy--;
+		if (dev->kd_busy == 0) {
+			cv_broadcast(knowndevs_cv, knowndevs_lock);
+		}
+	}
+	lock_release(knowndevs_lock);
 
 	return 0;
 }
 
+/*
+ * Wait until nobody is syncing KD's filesystem. Returns false if it
+ * was unmounted while we waited.
+ */
+static
+bool
+vfs_waitidle(struct knowndev *kd)
+{
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+
+	while (kd->kd_fs != NULL && kd->kd_busy > 0) {
+		cv_wait(knowndevs_cv, knowndevs_lock);
+	}
+	return kd->kd_fs != NULL;
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
  */
 int
-vfs_getroot(const char *devname, struct vnode **result)
+vfs_getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
+	int result = ENODEV;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -200,14 +217,16 @@ vfs_getroot(const char *devname, struct vnode **result)
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				*result = FSOP_GETROOT(kd->kd_fs);
-				return 0;
+				*ret = FSOP_GETROOT(kd->kd_fs);
+				result = 0;
+				break;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
-				return ENXIO;
+				result = ENXIO;
+				break;
 			}
 		}
 
@@ -221,8 +240,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 			KASSERT(kd->kd_rawname==NULL);
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -232,8 +252,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 		if (kd->kd_rawname!=NULL && !strcmp(kd->kd_rawname, devname)) {
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -244,10 +265,12 @@ vfs_getroot(const char *devname, struct vnode **result)
 	}
 
 	/*
-	 * If we got here, the device specified by devname doesn't exist.
+	 * If we fell off the end, the device specified by devname
+	 * doesn't exist, and RESULT is still ENODEV.
 	 */
 
-	return ENODEV;
+	lock_release(knowndevs_lock);
+	return result;
 }
 
 /*
@@ -258,10 +281,11 @@ vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
 	unsigned i, num;
+	const char *name = NULL;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -274,11 +298,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	lock_release(knowndevs_lock);
+	return name;
 }
 
 /*
@@ -338,7 +364,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -378,7 +404,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	unsigned index;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -406,13 +432,14 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_busy = 0;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
 	}
 
 	if (badnames(name, rawname, volname)) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return EEXIST;
 	}
 
@@ -423,7 +450,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return result;
 
  nomem:
@@ -441,7 +468,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 	
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return ENOMEM;
 }
 
@@ -480,7 +507,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -514,16 +541,16 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -531,7 +558,7 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(knowndevs_lock);
 		return result;
 	}
 
@@ -543,7 +570,7 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return 0;
 }
 
@@ -555,30 +582,38 @@ int
 vfs_unmount(const char *devname)
 {
 	struct knowndev *kd;
+	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
 		goto fail;
 	}
 
-	if (kd->kd_fs == NULL) {
+	if (!vfs_waitidle(kd)) {
 		result = EINVAL;
 		goto fail;
 	}
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
-	result = FSOP_SYNC(kd->kd_fs);
+	/*
+	 * The name cache holds references that would keep the fs busy;
+	 * drop them, and keep lookups from adding more until we're done.
+	 */
+	fs = kd->kd_fs;
+	dcache_closefs(fs);
+
+	result = FSOP_SYNC(fs);
 	if (result) {
-		goto fail;
+		goto reopen;
 	}
 
-	result = FSOP_UNMOUNT(kd->kd_fs);
+	result = FSOP_UNMOUNT(fs);
 	if (result) {
-		goto fail;
+		goto reopen;
 	}
 
 	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
@@ -588,8 +623,10 @@ vfs_unmount(const char *devname)
 
 	KASSERT(result==0);
 
+ reopen:
+	dcache_openfs(fs);
  fail:
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 	return result;
 }
 
@@ -600,10 +637,11 @@ int
 vfs_unmountall(void)
 {
 	struct knowndev *dev;
+	struct fs *fs;
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -612,13 +650,16 @@ vfs_unmountall(void)
 			/* not mountable/unmountable */
 			continue;
 		}
-		if (dev->kd_fs == NULL) {
+		if (!vfs_waitidle(dev)) {
 			/* not mounted */
 			continue;
 		}
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		fs = dev->kd_fs;
+		dcache_closefs(fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -629,6 +670,7 @@ vfs_unmountall(void)
 				kprintf("vfs: Warning: sync failed second time"
 					" for %s: %s, giving up...\n",
 					dev->kd_name, strerror(result));
+				dcache_openfs(fs);
 				continue;
 			}
 		}
@@ -637,20 +679,23 @@ vfs_unmountall(void)
 		if (result == EBUSY) {
 			kprintf("vfs: Cannot unmount %s: (busy)\n", 
 				dev->kd_name);
+			dcache_openfs(fs);
 			continue;
 		}
 		if (result) {
 			kprintf("vfs: Warning: unmount failed for %s:"
 				" %s, already synced, dropping...\n",
 				dev->kd_name, strerror(result));
+			dcache_openfs(fs);
 			continue;
 		}
 
 		/* now drop the filesystem */
 		dev->kd_fs = NULL;
+		dcache_openfs(fs);
 	}
 
-	vfs_biglock_release();
+	lock_release(knowndevs_lock);
 
 	return 0;
 }
@@ -38,6 +38,8 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
+#include <dcache.h>
 
 
 /* Does most of the work for open(). */
@@ -100,6 +102,7 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 			result = EINVAL;
 		}
 		else {
+			vm_text_invalidate(vn);
 			result = VOP_TRUNCATE(vn, 0);
 		}
 		if (result) {
@@ -312,6 +315,10 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		/* sfs has no rmdir of its own to invalidate from */
+		dcache_invalidate(parent, name);
+	}
 
 	VOP_DECREF(parent);
 
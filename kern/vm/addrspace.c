@@ -29,11 +29,13 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
 #include <uio.h>
+#include <synch.h>
 #include <thread.h>
 #include <current.h>
 #include <addrspace.h>
@@ -76,13 +78,26 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_pagetable = pagetable_create();
+	if (as->as_pagetable == NULL) {
+		vm_object_array_destroy(as->as_objects);
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+
+	as_machdep_init(&as->as_machdep);
+
 	return as;
 }
 
 /*
  * as_copy: duplicate an address space. Creates a new address space and
  * copies each vm_object in the source address space into the new one.
- * Implements the VM system part of fork().
+ * Implements the VM system part of fork(). The pages themselves are
+ * shared copy-on-write until one side or the other writes to them.
  *
  * Synchronization: none.
  */
@@ -115,7 +130,7 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 
-		result = vm_object_copy(vmo, newas, &newvmo);
+		result = vm_object_copy(vmo, &newvmo);
 		if (result) {
 			goto fail;
 		}
@@ -125,7 +140,12 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 			vm_object_destroy(newas, newvmo);
 			goto fail;
 		}
+
+		if (vmo == as->as_heap) {
+			newas->as_heap = newvmo;
+		}
 	}
+	newas->as_heapend = as->as_heapend;
 	
 	*ret = newas;
 	return 0;
@@ -139,6 +159,15 @@ fail:
  * as_fault: fault handling. Handle a fault on an address space, of
  * specified type, at specified address.
  *
+ * If the page table already has the lpage, and the fault isn't a
+ * write to a shared page, go straight to lpage_fault. This is the
+ * path for TLB misses on pages that exist, which is most of them.
+ * Writes to mappings that aren't writeable never take it: their
+ * pages are always shared with a text object.
+ * Otherwise search the vm_objects, and remember what we find in the
+ * page table. Reads of pages that have never been touched map the
+ * shared zero frame, and don't create a page until the first write.
+ *
  * Synchronization: none. We assume the address space is not shared,
  * so we don't lock it.
  */
@@ -146,11 +175,24 @@ int
 as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 {
 	struct vm_object *faultobj = NULL;
-	struct lpage *lp;
+	struct lpage *lp, *newlp;
 	vaddr_t bot=0, top;
 	unsigned i, index;
 	int result;
 
+	va &= PAGE_FRAME;
+
+	/*
+	 * Fast path. lp_refcount can only go up by forking this address
+	 * space, which we aren't doing, so reading it unlocked is safe;
+	 * if it drops to 1 under us the slow path copes.
+	 */
+	lp = pagetable_lookup(as->as_pagetable, va);
+	if (lp != NULL &&
+	    (faulttype == VM_FAULT_READ || lp->lp_refcount == 1)) {
+		return lpage_fault(lp, as, faulttype, va);
+	}
+
 	/* Find the vm_object concerned */
 	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
 		struct vm_object *vmo;
@@ -169,11 +211,36 @@ as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 		return EFAULT; //XXX [Hugh] vaddr is outside segments, aka SIGSEGV
 	}
 
+	if (faulttype != VM_FAULT_READ && !faultobj->vmo_writeable) {
+		DEBUG(DB_VM, "as_fault: EFAULT: write to read-only va=0x%x\n",
+		      va);
+		return EFAULT;
+	}
+
 	/* Now get the logical page */
 	index = (va - bot) / PAGE_SIZE;
 	lp = lpage_array_get(faultobj->vmo_lpages, index);
 
-	if (lp == NULL) {
+	if (lp == NULL && vm_object_iszero(faultobj, index)) {
+		if (faulttype == VM_FAULT_READ) {
+			/* untouched: read the zero frame until written */
+			mmu_map_zero(as, va);
+			return 0;
+		}
+		/* a read fault may have mapped the zero frame here */
+		mmu_unmap(as, va);
+	}
+
+	if (lp == NULL && faultobj->vmo_vnode != NULL) {
+		/* first touch of a file-backed page: read it in */
+		result = vm_object_filefill(faultobj, index, &lp);
+		if (result) {
+			kprintf("vm: file fault at 0x%x failed\n", va);
+			return result;
+		}
+		lpage_array_set(faultobj->vmo_lpages, index, lp);
+	}
+	else if (lp == NULL) {
 		/* zerofill page */
 		result = lpage_zerofill(&lp);
 		if (result) {
@@ -182,7 +249,32 @@ as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 		}
 		lpage_array_set(faultobj->vmo_lpages, index, lp);
 	}
-	
+
+	/*
+	 * A page from a text object may be shared even if it's new.
+	 * Hold vmo_lock while replacing it, as the old one may go away.
+	 */
+	if (faulttype != VM_FAULT_READ) {
+		/* copy-on-write: get our own copy before writing */
+		lock_acquire(faultobj->vmo_lock);
+		result = lpage_unshare(lp, &newlp);
+		if (result) {
+			lock_release(faultobj->vmo_lock);
+			kprintf("vm: copy-on-write fault at 0x%x failed\n", va);
+			return result;
+		}
+		if (newlp != lp) {
+			lpage_array_set(faultobj->vmo_lpages, index, newlp);
+			lp = newlp;
+		}
+		lock_release(faultobj->vmo_lock);
+	}
+
+	/* so pageouts can find its neighbours */
+	lpage_setowner(lp, faultobj, index);
+
+	pagetable_set(as->as_pagetable, va, lp);
+
 	return lpage_fault(lp, as, faulttype, va);
 }
 
@@ -196,6 +288,9 @@ as_destroy(struct addrspace *as)
 	struct vm_object *vmo;
 	unsigned i;
 
+	/* get it out of every TLB in one go, not page by page */
+	mmu_unmap_as(as);
+
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 		vm_object_destroy(as, vmo);
@@ -203,6 +298,7 @@ as_destroy(struct addrspace *as)
 
 	vm_object_array_setsize(as->as_objects, 0);
 	vm_object_array_destroy(as->as_objects);
+	pagetable_destroy(as->as_pagetable);
 	kfree(as);
 }
 
@@ -299,6 +395,201 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return 0;
 }
 
+/*
+ * as_define_file: back the region at VADDR with the file V, so the
+ * program image is demand-paged instead of being read in at exec
+ * time. FILESIZE bytes at VADDR come from file offset OFFSET; the
+ * rest of the MEMSIZE bytes of the region are zerofill. The region
+ * must already have been set up with as_define_region.
+ *
+ * Segments that aren't writeable are shared (copy-on-write) with
+ * every other process running the same executable.
+ */
+int
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t memsize, size_t filesize, int writeable)
+{
+	struct vm_object *vmo;
+	vaddr_t bot, top;
+	unsigned i;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	if (filesize == 0) {
+		/* all bss */
+		return 0;
+	}
+
+	if (vaddr >= USERSPACETOP || filesize > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		bot = vmo->vmo_base;
+		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (vaddr >= bot && vaddr + filesize <= top) {
+			return vm_object_setfile(vmo, v, offset, vaddr,
+						 filesize, !writeable);
+		}
+	}
+
+	return EFAULT;
+}
+
+/*
+ * as_findspace: find a free, page-aligned range of NPAGES pages for a
+ * mapping. We search downward from the top of the user address space,
+ * skipping over each region (with its redzone) in the way, and never
+ * go below the heap's current size, so mappings pile up under the
+ * stack and the heap can grow up towards them.
+ */
+static
+int
+as_findspace(struct addrspace *as, unsigned npages, vaddr_t *ret)
+{
+	struct vm_object *vmo;
+	vaddr_t top, base, bot, otop, floor;
+	size_t sz;
+	unsigned i;
+
+	sz = npages * PAGE_SIZE;
+	floor = as->as_heap != NULL ? ROUNDUP(as->as_heapend, PAGE_SIZE) : 0;
+
+	top = USERSPACETOP;
+ again:
+	if (top < floor || top - floor < sz) {
+		return ENOMEM;
+	}
+	base = top - sz;
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+		otop = vmo->vmo_base +
+			PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (base < otop && base + sz > bot) {
+			top = bot;
+			goto again;
+		}
+	}
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * as_mmap: map LEN bytes of the file V, starting at file offset
+ * OFFSET (which must be page-aligned), at an address of our choosing,
+ * returned in RET. Pages are read in from the file as they're touched.
+ *
+ * Mappings that aren't writeable share their pages with any other
+ * identical read-only mapping, like program text does, and writes to
+ * them fault. Writeable shared mappings write the pages that were
+ * changed back to the file at munmap or exit; writeable private ones
+ * never write to the file. Writeable mappings have private pages
+ * either way; see vmprivate.h.
+ */
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	int writeable, int shared, vaddr_t *ret)
+{
+	struct vm_object *vmo;
+	struct stat st;
+	unsigned npages;
+	size_t filesize;
+	vaddr_t base;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset >= st.st_size) {
+		filesize = 0;
+	}
+	else if (st.st_size - offset < (off_t)len) {
+		filesize = st.st_size - offset;
+	}
+	else {
+		filesize = len;
+	}
+
+	result = as_findspace(as, npages, &base);
+	if (result) {
+		return result;
+	}
+
+	vmo = vm_object_create(npages);
+	if (vmo == NULL) {
+		return ENOMEM;
+	}
+	vmo->vmo_base = base;
+	vmo->vmo_lower_redzone = 0;
+	vmo->vmo_ismmap = true;
+	vmo->vmo_writeable = writeable;
+
+	if (filesize > 0) {
+		result = vm_object_setfile(vmo, v, offset, base, filesize,
+					   !writeable);
+		if (result) {
+			vm_object_destroy(as, vmo);
+			return result;
+		}
+		vmo->vmo_writeback = writeable && shared;
+	}
+
+	result = vm_object_array_add(as->as_objects, vmo, NULL);
+	if (result) {
+		vmo->vmo_writeback = false;
+		vm_object_destroy(as, vmo);
+		return result;
+	}
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * as_munmap: remove the mapping at ADDR, writing it back to its file
+ * first if need be. Only whole mappings, as returned by as_mmap, can
+ * be unmapped.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_object *vmo;
+	unsigned i;
+
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		if (vmo->vmo_ismmap && vmo->vmo_base == addr) {
+			break;
+		}
+	}
+	if (i == vm_object_array_num(as->as_objects)) {
+		return EINVAL;
+	}
+	if (ROUNDUP(len, PAGE_SIZE) !=
+	    PAGE_SIZE * lpage_array_num(vmo->vmo_lpages)) {
+		return EINVAL;
+	}
+
+	vm_object_array_remove(as->as_objects, i);
+	vm_object_destroy(as, vmo);
+	return 0;
+}
+
 /*
  * as_prepare_load: called before loading executable segments.
  */
@@ -314,16 +605,104 @@ as_prepare_load(struct addrspace *as)
 }
 
 /*
- * as_complete_load: called after loading executable segments.
+ * as_complete_load: called after loading executable segments. Sets
+ * up the heap: an empty vm_object starting at the first page above
+ * all the program's segments, for as_sbrk to grow.
  */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Do nothing.
-	 */
+	struct vm_object *vmo;
+	vaddr_t top, heapbase;
+	unsigned i;
+	int result;
 
-	(void)as;
+	KASSERT(as->as_heap == NULL);
+
+	heapbase = 0;
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		top = vmo->vmo_base + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (top > heapbase) {
+			heapbase = top;
+		}
+	}
+
+	vmo = vm_object_create(0);
+	if (vmo == NULL) {
+		return ENOMEM;
+	}
+	vmo->vmo_base = heapbase;
+	vmo->vmo_lower_redzone = 0;
+
+	result = vm_object_array_add(as->as_objects, vmo, NULL);
+	if (result) {
+		vm_object_destroy(as, vmo);
+		return result;
+	}
+
+	as->as_heap = vmo;
+	as->as_heapend = heapbase;
+	return 0;
+}
+
+/*
+ * as_sbrk: move the end of the heap by AMOUNT bytes and hand back the
+ * old end in OLDBREAK. The heap vm_object is resized to cover the new
+ * break; new pages are zerofill, and pages given back are freed (RAM
+ * and swap) right away by vm_object_setsize.
+ *
+ * The heap may not grow into another region or its redzone (in
+ * practice, the stack's guard band).
+ *
+ * Synchronization: none. We assume the address space is not shared.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct vm_object *heap, *vmo;
+	vaddr_t newbreak, newtop, bot;
+	unsigned i;
+	int result;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return EINVAL;
+	}
+	KASSERT(as->as_heapend >= heap->vmo_base);
+
+	if (amount < 0) {
+		if ((vaddr_t)-amount > as->as_heapend - heap->vmo_base) {
+			return EINVAL;
+		}
+	}
+	else if ((vaddr_t)amount > USERSPACETOP - as->as_heapend) {
+		return ENOMEM;
+	}
+	newbreak = as->as_heapend + amount;
+	newtop = ROUNDUP(newbreak, PAGE_SIZE);
+
+	if (amount > 0) {
+		for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+			vmo = vm_object_array_get(as->as_objects, i);
+			if (vmo == heap || vmo->vmo_base < heap->vmo_base) {
+				continue;
+			}
+			bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+			if (newtop > bot) {
+				return ENOMEM;
+			}
+		}
+	}
+
+	result = vm_object_setsize(as, heap,
+				   (newtop - heap->vmo_base) / PAGE_SIZE);
+	if (result) {
+		return result;
+	}
+
+	*oldbreak = as->as_heapend;
+	as->as_heapend = newbreak;
 	return 0;
 }
 
@@ -28,8 +28,13 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <mainbus.h>
 #include <vm.h>
 
 /*
@@ -71,9 +76,12 @@ fill_deadbeef(void *vptr, size_t len)
 //    sizes, and large numbers of items of the new size are allocated.
 //
 //    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    pageref structures, which live on a list per block size and in a
+//    hash table keyed by page address, so kfree can find the pageref
+//    for a pointer without searching. Maintaining the pagerefs is a
+//    nuisance, because they cannot recursively use the subpage
+//    allocator; instead we carve them out of whole pages obtained
+//    with alloc_kpages. Those pages are never given back.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -103,7 +111,8 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref **prev_samesize;	/* pointer to our list link */
+	struct pageref *next_hash;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,87 +127,190 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pageref storage. Free pagerefs are kept on a list threaded through
+ * next_samesize. When it runs dry, subpage_kmalloc gets another page
+ * and cuts it up with addpagerefs.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *freepagerefs;
+static unsigned npagerefpages;
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	pr = freepagerefs;
+	if (pr != NULL) {
+		freepagerefs = pr->next_samesize;
+		pr->next_samesize = NULL;
 	}
-
-	/* ran out */
-	return NULL;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->next_samesize = freepagerefs;
+	p->prev_samesize = NULL;
+	freepagerefs = p;
+}
+
+static
+void
+addpagerefs(vaddr_t page)
+{
+	struct pageref *prs = (struct pageref *)page;
+	unsigned i;
+
+	for (i=0; i<PAGEREFS_PER_PAGE; i++) {
+		freepageref(&prs[i]);
+	}
+	npagerefpages++;
 }
 
 ////////////////////////////////////////
 
+/*
+ * Hash table mapping page addresses to pagerefs. The kernel heap is
+ * at most a few thousand pages in practice, so chains stay short.
+ */
+
+#define PR_HASHSIZE 256
+#define PR_HASH(pageaddr) (((pageaddr) / PAGE_SIZE) % PR_HASHSIZE)
+
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+static struct pageref *pagehash[PR_HASHSIZE];
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the global heap. Most calls don't get this
+ * far; see the per-cpu magazines below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 ////////////////////////////////////////
 
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps, for each size class, a stack of up to
+ * KMALLOC_MAGSIZE free blocks (struct kmalloc_magazine, in struct
+ * cpu). kmalloc and kfree work on the current cpu's magazine with
+ * interrupts off, which also keeps the thread from migrating, and
+ * only take kmalloc_spinlock when the magazine is empty or full. Then
+ * they move MAG_BATCH blocks at once, so the next several calls stay
+ * local.
+ *
+ * Blocks sitting in a magazine still count as allocated as far as
+ * their page is concerned, so a page with cached blocks won't be
+ * released. That's at most KMALLOC_MAGSIZE blocks per class per cpu.
+ *
+ * kfree has to find the size class of a block without the lock, so
+ * we also keep one byte per physical page recording the size class
+ * of each subpage page (PAGECLASS_NONE for other pages). It's set
+ * when a page is given to the subpage allocator and reset when the
+ * page is given back, neither of which can happen while a block on
+ * that page is in use, so it can be read without locking.
+ */
+
+#define MAG_BATCH (KMALLOC_MAGSIZE / 2)
+
+#define PAGECLASS_NONE 0xff
+
+static uint8_t *pageclasses;
+static unsigned npageclasses;
+
+static struct kmalloc_cpucache *allcaches;
+
+void
+kmalloc_cpu_init(struct cpu *c)
+{
+	struct kmalloc_cpucache *kc = &c->c_kmalloc;
+	unsigned i;
+
+	COMPILE_ASSERT(KMALLOC_NSIZES == NSIZES);
+
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_mags[i].km_count = 0;
+		kc->kc_mags[i].km_hits = 0;
+		kc->kc_mags[i].km_misses = 0;
+	}
+	kc->kc_cpunum = c->c_number;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kc->kc_next = allcaches;
+	allcaches = kc;
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Allocate the page class table. This happens the first time the
+ * subpage allocator needs a page, which is early in boot.
+ */
+static
+int
+pageclass_init(void)
+{
+	unsigned i, n;
+	vaddr_t table;
+
+	n = mainbus_ramsize() / PAGE_SIZE;
+	table = alloc_kpages(DIVROUNDUP(n, PAGE_SIZE));
+	if (table == 0) {
+		return ENOMEM;
+	}
+	for (i=0; i<n; i++) {
+		((uint8_t *)table)[i] = PAGECLASS_NONE;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pageclasses == NULL) {
+		pageclasses = (uint8_t *)table;
+		npageclasses = n;
+		table = 0;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (table != 0) {
+		/* someone else beat us to it */
+		free_kpages(table);
+	}
+	return 0;
+}
+
+static
+inline
+unsigned
+pageclass_index(vaddr_t addr)
+{
+	unsigned ix;
+
+	ix = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	KASSERT(ix < npageclasses);
+	return ix;
+}
+
+/* Size class of the page ADDR is on, or PAGECLASS_NONE. */
+static
+inline
+unsigned
+pageclass_get(vaddr_t addr)
+{
+	if (pageclasses == NULL) {
+		return PAGECLASS_NONE;
+	}
+	return pageclasses[pageclass_index(addr)];
+}
+
+////////////////////////////////////////
+
 /* SLOWER implies SLOW */
 #ifdef SLOWER
 #ifndef SLOW
@@ -253,25 +365,29 @@ checksubpages(void)
 {
 	struct pageref *pr;
 	int i;
-	unsigned sc=0, ac=0;
+	unsigned sc=0, hc=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(*pr->prev_samesize == pr);
+			KASSERT(sc < npagerefpages * PAGEREFS_PER_PAGE);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+	for (i=0; i<PR_HASHSIZE; i++) {
+		for (pr = pagehash[i]; pr != NULL; pr = pr->next_hash) {
+			checksubpage(pr);
+			KASSERT(PR_HASH(PR_PAGEADDR(pr)) == (unsigned)i);
+			KASSERT(hc < npagerefpages * PAGEREFS_PER_PAGE);
+			hc++;
+		}
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc==hc);
 }
 #else
 #define checksubpages() 
@@ -334,14 +450,42 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	int i;
+
+	struct kmalloc_cpucache *kc;
+	uint32_t hits, misses;
+	unsigned j;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
-	kprintf("Subpage allocator status:\n");
+	/* The counters belong to their cpus; this is only a snapshot. */
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		hits = misses = 0;
+		for (j=0; j<NSIZES; j++) {
+			hits += kc->kc_mags[j].km_hits;
+			misses += kc->kc_mags[j].km_misses;
+		}
+		kprintf("cpu%u: %lu magazine hits %lu misses (%lu%% hit rate)\n",
+			kc->kc_cpunum, (unsigned long) hits,
+			(unsigned long) misses,
+			(unsigned long) (hits + misses == 0 ? 0 :
+					 (100ULL * hits) / (hits + misses)));
+		kprintf("     cached:");
+		for (j=0; j<NSIZES; j++) {
+			kprintf(" %lu/%u", (unsigned long) sizes[j],
+				kc->kc_mags[j].km_count);
+		}
+		kprintf("\n");
+	}
+
+	kprintf("Subpage allocator status (%u pages of pagerefs):\n",
+		npagerefpages);
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	for (i=0; i<NSIZES; i++) {
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			dumpsubpage(pr);
+		}
 	}
 
 	spinlock_release(&kmalloc_spinlock);
@@ -349,6 +493,26 @@ kheap_printstats(void)
 
 ////////////////////////////////////////
 
+static
+void
+add_lists(struct pageref *pr, int blktype)
+{
+	struct pageref **bucket;
+
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
+	}
+	pr->prev_samesize = &sizebases[blktype];
+	sizebases[blktype] = pr;
+
+	bucket = &pagehash[PR_HASH(PR_PAGEADDR(pr))];
+	pr->next_hash = *bucket;
+	*bucket = pr;
+}
+
 static
 void
 remove_lists(struct pageref *pr, int blktype)
@@ -356,22 +520,46 @@ remove_lists(struct pageref *pr, int blktype)
 	struct pageref **guy;
 
 	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(*pr->prev_samesize == pr);
+
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = NULL;
+	pr->prev_samesize = NULL;
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
+	for (guy = &pagehash[PR_HASH(PR_PAGEADDR(pr))]; *guy;
+	     guy = &(*guy)->next_hash) {
 		checksubpage(*guy);
 		if (*guy == pr) {
-			*guy = pr->next_samesize;
+			*guy = pr->next_hash;
 			break;
 		}
 	}
+	pr->next_hash = NULL;
+}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+/*
+ * Find the pageref for the page containing ADDR, or NULL if it isn't
+ * a subpage allocator page.
+ */
+static
+struct pageref *
+findpageref(vaddr_t addr)
+{
+	struct pageref *pr;
+	vaddr_t page;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	page = addr & PAGE_FRAME;
+	for (pr = pagehash[PR_HASH(page)]; pr != NULL; pr = pr->next_hash) {
+		if (PR_PAGEADDR(pr) == page) {
+			return pr;
 		}
 	}
+	return NULL;
 }
 
 static
@@ -392,16 +580,120 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block off a page's freelist.
+ */
+static
+void *
+subpage_take(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Put one block back on its page's freelist. If that makes the whole
+ * page free, take the page out of the subpage allocator and return
+ * its address so the caller can free_kpages it (which must be done
+ * without kmalloc_spinlock); otherwise return 0.
+ */
+static
+vaddr_t
+subpage_put(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	ptraddr = (vaddr_t)ptr;
+
+	pr = findpageref(ptraddr);
+	if (pr==NULL) {
+		panic("kfree: subpage free of %p not on a subpage page\n",
+		      ptr);
+	}
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
+	offset = ptraddr - prpage;
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		pageclasses[pageclass_index(prpage)] = PAGECLASS_NONE;
+		return prpage;
+	}
+	return 0;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
 {
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
+	struct kmalloc_magazine *mag; // this cpu's magazine for blktype
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t refpage;	// new page of pagerefs, if needed
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
+	int spl;
 
 	volatile int i;
 
@@ -409,6 +701,23 @@ subpage_kmalloc(size_t sz)
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
+	/*
+	 * Fast path: use this cpu's magazine. (Not until the cpu
+	 * structures exist, though.)
+	 */
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &curcpu->c_kmalloc.kc_mags[blktype];
+		if (mag->km_count > 0) {
+			retptr = mag->km_blocks[--mag->km_count];
+			mag->km_hits++;
+			splx(spl);
+			return retptr;
+		}
+		mag->km_misses++;
+		splx(spl);
+	}
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -423,24 +732,20 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
+			retptr = subpage_take(pr);
+
+			/*
+			 * Refill this cpu's magazine from the same page
+			 * while we have the lock. Holding a spinlock
+			 * keeps us on this cpu.
+			 */
+			if (CURCPU_EXISTS()) {
+				mag = &curcpu->c_kmalloc.kc_mags[blktype];
+				while (mag->km_count < MAG_BATCH &&
+				       pr->nfree > 0) {
+					mag->km_blocks[mag->km_count++] =
+						subpage_take(pr);
+				}
 			}
 
 			checksubpages();
@@ -460,6 +765,11 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
+	if (pageclasses == NULL && pageclass_init()) {
+		kprintf("kmalloc: Subpage allocator couldn't get page "
+			"class table\n"); 
+		return NULL;
+	}
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
@@ -468,13 +778,19 @@ subpage_kmalloc(size_t sz)
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
+		/* Out of pagerefs; get another page's worth. */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			/* Couldn't allocate accounting space for the page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefs(refpage);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -498,57 +814,28 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
-
-	pr->next_all = allbase;
-	allbase = pr;
+	add_lists(pr, blktype);
+	KASSERT(pageclasses[pageclass_index(prpage)] == PAGECLASS_NONE);
+	pageclasses[pageclass_index(prpage)] = blktype;
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_kfree(void *ptr, unsigned blktype)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	struct kmalloc_magazine *mag;
+	vaddr_t freepages[MAG_BATCH+1];
+	unsigned i, nfreepages;
+	vaddr_t page;
+	int spl;
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
-
-	offset = ptraddr - prpage;
-
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	/* Check for proper alignment */
+	if (((vaddr_t)ptr & ~PAGE_FRAME) % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -558,41 +845,52 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
+	nfreepages = 0;
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &curcpu->c_kmalloc.kc_mags[blktype];
+		if (mag->km_count < KMALLOC_MAGSIZE) {
+			/* Fast path: keep it on this cpu. */
+			mag->km_blocks[mag->km_count++] = ptr;
+			mag->km_hits++;
+			splx(spl);
+			return;
+		}
+		mag->km_misses++;
+
+		/* Magazine full; give back half of it along with PTR. */
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (i=0; i<MAG_BATCH; i++) {
+			page = subpage_put(mag->km_blocks[--mag->km_count]);
+			if (page != 0) {
+				freepages[nfreepages++] = page;
+			}
+		}
+		page = subpage_put(ptr);
+		if (page != 0) {
+			freepages[nfreepages++] = page;
+		}
+		checksubpages();
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		splx(spl);
 	}
 	else {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		page = subpage_put(ptr);
+		if (page != 0) {
+			freepages[nfreepages++] = page;
+		}
+		checksubpages();
 		spinlock_release(&kmalloc_spinlock);
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
-
-	return 0;
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
 }
 
 //
@@ -621,14 +919,22 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	unsigned blktype;
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+	/*
+	 * The page class table tells us whether it's a subpage block,
+	 * and if so what size; otherwise it's a big allocation.
+	 */
+	blktype = pageclass_get((vaddr_t)ptr);
+	if (blktype != PAGECLASS_NONE) {
+		subpage_kfree(ptr, blktype);
+	}
+	else {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See kmem.h.
+ *
+ * Each cache keeps up to kc_maxfree constructed objects in an array
+ * used as a stack, so the most recently freed (and most likely still
+ * in the processor cache) object is handed out first. The array is
+ * protected by a per-cache spinlock; the constructor, destructor, and
+ * the underlying kmalloc/kfree calls all happen with it released.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem.h>
+
+/* All caches that have ever allocated anything, for kmem_printstats. */
+static struct spinlock kmem_listlock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_allcaches;
+
+/*
+ * Put a cache on the stats list if it isn't there yet. Done on the
+ * first allocation so statically-initialized caches show up too.
+ */
+static
+void
+kmem_cache_list(struct kmem_cache *kc)
+{
+	spinlock_acquire(&kmem_listlock);
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_allcaches;
+		kmem_allcaches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&kmem_listlock);
+}
+
+static
+void
+kmem_cache_unlist(struct kmem_cache *kc)
+{
+	struct kmem_cache **pp;
+
+	spinlock_acquire(&kmem_listlock);
+	if (kc->kc_listed) {
+		for (pp = &kmem_allcaches; *pp != kc; pp = &(*pp)->kc_next) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = kc->kc_next;
+		kc->kc_next = NULL;
+		kc->kc_listed = false;
+	}
+	spinlock_release(&kmem_listlock);
+}
+
+/*
+ * Create a cache.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, unsigned maxfree,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+	KASSERT(maxfree <= KMEM_CACHE_MAXFREE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_maxfree = maxfree;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nfree = 0;
+	kc->kc_nalloc = 0;
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
+	kc->kc_next = NULL;
+	kc->kc_listed = false;
+	return kc;
+}
+
+/*
+ * Destroy a cache. All its objects must have been freed.
+ */
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	void *obj;
+
+	kmem_cache_unlist(kc);
+
+	KASSERT(kc->kc_nalloc == 0);
+	while (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(obj);
+		}
+		kfree(obj);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+/*
+ * Get an object. If there's a constructed one on the free list, this
+ * is just a pop; otherwise allocate and construct a new one.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_nalloc++;
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	kc->kc_misses++;
+	spinlock_release(&kc->kc_lock);
+
+	if (!kc->kc_listed) {
+		kmem_cache_list(kc);
+	}
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL && kc->kc_ctor(obj)) {
+		kfree(obj);
+		return NULL;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_nalloc++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+/*
+ * Return an object, which must be in its constructed state. Keep it
+ * if there's room; otherwise destroy it.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_nalloc > 0);
+	kc->kc_nalloc--;
+	if (kc->kc_nfree < kc->kc_maxfree) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Print stats for all caches.
+ *
+ * The numbers are read without the per-cache locks; they're only
+ * informational. We can't hold kmem_listlock across kprintf (which
+ * may sleep) either; caches are added at the head of the list, so
+ * walking it from a snapshot of the head is safe unless someone
+ * destroys a cache at the same time, which we don't bother with.
+ */
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned total, pct;
+
+	kprintf("%-12s %6s %6s %6s %10s %10s %5s\n",
+		"cache", "size", "inuse", "free", "hits", "misses", "hit%");
+
+	spinlock_acquire(&kmem_listlock);
+	kc = kmem_allcaches;
+	spinlock_release(&kmem_listlock);
+
+	for (; kc != NULL; kc = kc->kc_next) {
+		total = kc->kc_hits + kc->kc_misses;
+		pct = total == 0 ? 0 : (unsigned)(100ULL * kc->kc_hits / total);
+		kprintf("%-12s %6u %6u %6u %10u %10u %4u%%\n",
+			kc->kc_name, (unsigned)kc->kc_size, kc->kc_nalloc,
+			kc->kc_nfree, kc->kc_hits, kc->kc_misses, pct);
+	}
+}
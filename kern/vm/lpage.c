@@ -30,7 +30,10 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <uio.h>
 #include <spinlock.h>
+#include <wchan.h>
+#include <kmem.h>
 #include <synch.h>
 #include <thread.h>
 #include <addrspace.h>
@@ -38,6 +41,7 @@
 #include <vmprivate.h>
 #include <machine/coremap.h>
 #include <current.h>
+#include <vnode.h>
 
 /* 
  * lpage operations
@@ -45,35 +49,96 @@
 
 /* Stats counters */
 static volatile uint32_t ct_zerofills;
+static volatile uint32_t ct_filefills;
+static volatile uint32_t ct_cowcopies;
 static volatile uint32_t ct_minfaults;
 static volatile uint32_t ct_majfaults;
 static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
+static volatile uint32_t ct_cluster_cleans;
+static volatile uint32_t ct_readaheads;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Threads that find an lpage busy (LPF_BUSY: being paged in by someone
+ * else) wait here. One channel for all lpages; it's only used while a
+ * page is in transit.
+ */
+static struct wchan *lpage_busychan;
+
+/*
+ * lpage_bootstrap: set up the busy-wait channel.
+ */
+void
+lpage_bootstrap(void)
+{
+	lpage_busychan = wchan_create("lpbusy");
+	if (lpage_busychan == NULL) {
+		panic("lpage_bootstrap: Out of memory\n");
+	}
+}
+
 
 void
 vm_printstats(void)
 {
-	uint32_t zf, mn, mj, de, we, te;
+	uint32_t zf, ff, cc, mn, mj, de, we, te, cl, ra;
 
 	spinlock_acquire(&stats_spinlock);
 	zf = ct_zerofills;
+	ff = ct_filefills;
+	cc = ct_cowcopies;
 	mn = ct_minfaults;
 	mj = ct_majfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
+	cl = ct_cluster_cleans;
+	ra = ct_readaheads;
 	spinlock_release(&stats_spinlock);
 
 	te = de+we;
 
 	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults\n",
 		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
+	kprintf("vm: %lu pages read from executables\n", (unsigned long) ff);
+	kprintf("vm: %lu copy-on-write copies\n", (unsigned long) cc);
 	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
 		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu pages cleaned with an eviction, %lu read ahead\n",
+		(unsigned long) cl, (unsigned long) ra);
+	swap_printstats();
 	vm_printmdstats();
 }
 
+/*
+ * lpages come from an object cache; the ctor sets up the spinlock,
+ * which is the only part that survives between uses. Page faults
+ * and fork create and destroy these constantly, so keep the most
+ * the cache allows.
+ */
+static
+int
+lpage_ctor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_init(&lp->lp_spinlock);
+	return 0;
+}
+
+static
+void
+lpage_dtor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_cleanup(&lp->lp_spinlock);
+}
+
+static struct kmem_cache lpage_cache =
+	KMEM_CACHE_INITIALIZER("lpage", sizeof(struct lpage),
+			       KMEM_CACHE_MAXFREE, lpage_ctor, lpage_dtor);
+
 /*
  * Create a logical page object.
  * Synchronization: none.
@@ -83,28 +148,32 @@ lpage_create(void)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmem_cache_alloc(&lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
-	spinlock_init(&lp->lp_spinlock);
+	lp->lp_refcount = 1;
+	lp->lp_obj = NULL;
+	lp->lp_objindex = 0;
+	lp->lp_modified = false;
 
 	return lp;
 }
 
 /*
- * lpage_destroy: deallocates a logical page. Releases any RAM or swap
- * pages involved.
+ * lpage_destroy: drops a reference to a logical page. If it was the
+ * last one, deallocates the page and releases any RAM or swap pages
+ * involved, and the page's swap reservation. Otherwise, releases the
+ * swap reservation that was held on behalf of the departing sharer.
  *
  * Synchronization: Someone might be in the process of evicting the
  * page if it's resident, so it might be pinned. So lock and pin
  * together.
  *
- * We assume that lpages are not shared between address spaces and
- * address spaces are not shared between threads.
+ * We assume that address spaces are not shared between threads.
  */
 void 					
 lpage_destroy(struct lpage *lp)
@@ -115,7 +184,24 @@ lpage_destroy(struct lpage *lp)
 
 	lpage_lock_and_pin(lp);
 
+	KASSERT(lp->lp_refcount > 0);
+	lp->lp_refcount--;
 	pa = lp->lp_paddr & PAGE_FRAME;
+
+	if (lp->lp_refcount > 0) {
+		/*
+		 * Still shared; someone else gets to free it. Don't
+		 * leave it mapped on behalf of the departing sharer.
+		 */
+		lpage_unlock(lp);
+		if (pa != INVALID_PADDR) {
+			mmu_unmap_paddr(pa);
+			coremap_unpin(pa);
+		}
+		swap_unreserve(1);
+		return;
+	}
+
 	if (pa != INVALID_PADDR) {
 		DEBUG(DB_VM, "lpage_destroy: freeing paddr 0x%x\n", pa);
 		lp->lp_paddr = INVALID_PADDR;
@@ -132,9 +218,9 @@ lpage_destroy(struct lpage *lp)
 		      lp->lp_swapaddr);
 		swap_free(lp->lp_swapaddr);
 	}
+	swap_unreserve(1);
 
-	spinlock_cleanup(&lp->lp_spinlock);
-	kfree(lp);
+	kmem_cache_free(&lpage_cache, lp);
 }
 
 
@@ -214,53 +300,194 @@ lpage_lock_and_pin(struct lpage *lp)
 		/*
 		 * If what we just got out of the lpage is *now*
 		 * invalid, because the page was paged out on us,
-		 * we're done. The page can't be paged in again behind
-		 * our back, so assert it hasn't after regrabbing the
-		 * lpage lock.
+		 * relock and look again; another sharer may have
+		 * paged it back in meanwhile.
 		 */
-		if (pa == INVALID_PADDR) {
-			lpage_lock(lp);
-			KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-			break;
+		pinned = INVALID_PADDR;
+		if (pa != INVALID_PADDR) {
+			/* Pin what we got and try again. */
+			coremap_pin(pa);
+			pinned = pa;
 		}
-		/* Pin what we got and try again. */
-		coremap_pin(pa);
-		pinned = pa;
 		lpage_lock(lp);
 	}
 }
 
 /*
- * lpage_materialize: create a new lpage and allocate swap and RAM for it.
- * Do not do anything with the page contents though.
+ * lpage_waitbusy: wait for a page that someone else is paging in.
+ * Call with the lpage locked; returns with it unlocked, after which
+ * the caller should look again from the top.
+ */
+static
+void
+lpage_waitbusy(struct lpage *lp)
+{
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(LP_ISBUSY(lp));
+
+	wchan_lock(lpage_busychan);
+	lpage_unlock(lp);
+	wchan_sleep(lpage_busychan);
+}
+
+/*
+ * lpage_readahead: after LP, the page at VA in AS, has been marked
+ * busy for pagein from swap address SWA, find the pages following it
+ * in AS that are also in swap, in the following swap pages, so they
+ * can be read in the same I/O. They are marked busy too and put in
+ * LPS after LP; returns the total number of pages.
+ *
+ * We look in the page table, which only the thread that owns AS
+ * changes; the lpages it points at can't go away meanwhile because
+ * AS holds references to them.
+ */
+static
+unsigned
+lpage_readahead(struct addrspace *as, vaddr_t va, off_t swa,
+		struct lpage **lps)
+{
+	struct lpage *ra;
+	unsigned n;
+
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		if (va + n*PAGE_SIZE >= USERSPACETOP) {
+			break;
+		}
+		ra = pagetable_lookup(as->as_pagetable, va + n*PAGE_SIZE);
+		if (ra == NULL) {
+			break;
+		}
+		lpage_lock(ra);
+		if ((ra->lp_paddr & PAGE_FRAME) != INVALID_PADDR ||
+		    LP_ISBUSY(ra) ||
+		    ra->lp_swapaddr != swa + n*PAGE_SIZE) {
+			lpage_unlock(ra);
+			break;
+		}
+		LP_SET(ra, LPF_BUSY);
+		lpage_unlock(ra);
+		lps[n] = ra;
+	}
+	return n;
+}
+
+/*
+ * lpage_pagein: bring a non-resident lpage in from swap.
+ *
+ * Call with the lpage locked, not resident, and not busy. The lpage
+ * is marked busy while the I/O is in progress, so that other sharers
+ * wait for us instead of reading it in a second time, and so the
+ * lpage lock need not be held across the I/O. Other pageins and
+ * pageouts, of other pages, proceed in parallel.
+ *
+ * If AS is not NULL, the page is at VA in AS, and following pages
+ * that are in the following swap pages are read ahead in the same
+ * I/O (see lpage_readahead). They come in clean and unmapped. If
+ * there isn't memory for all of them, we read what we can.
+ *
+ * On success returns with the lpage locked and the new physical page
+ * (returned in PARET) pinned. On failure returns with it unlocked.
+ */
+static
+int
+lpage_pagein(struct lpage *lp, struct addrspace *as, vaddr_t va,
+	     paddr_t *paret)
+{
+	struct lpage *lps[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	unsigned i, n, got;
+	off_t swa;
+
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
+	KASSERT(!LP_ISBUSY(lp));
+
+	swa = lp->lp_swapaddr;
+	KASSERT(swa != INVALID_SWAPADDR);
+	LP_SET(lp, LPF_BUSY);
+	lpage_unlock(lp); // must not hold lpage locks before entering coremap
+
+	lps[0] = lp;
+	n = 1;
+	if (as != NULL) {
+		n = lpage_readahead(as, va, swa, lps);
+	}
+
+	for (i=0; i<n; i++) {
+		pas[i] = coremap_allocuser(lps[i]); // do evict if needed, also pin coremap
+		if (pas[i] == INVALID_PADDR) {
+			break;
+		}
+		KASSERT(coremap_pageispinned(pas[i]));
+	}
+	if (i < n) {
+		/* Out of memory; give up on the pages we have no room for. */
+		got = i;
+		for (; i<n; i++) {
+			lpage_lock(lps[i]);
+			LP_CLEAR(lps[i], LPF_BUSY);
+			lpage_unlock(lps[i]);
+		}
+		wchan_wakeall(lpage_busychan);
+		if (got == 0) {
+			return ENOMEM;
+		}
+		n = got;
+	}
+
+	swap_pagein(pas, n, swa);
+
+	for (i=1; i<n; i++) {
+		lpage_lock(lps[i]);
+		KASSERT(LP_ISBUSY(lps[i]));
+		lps[i]->lp_paddr = pas[i]; // clean and no longer busy
+		lpage_unlock(lps[i]);
+		coremap_unpin(pas[i]);
+	}
+	if (n > 1) {
+		spinlock_acquire(&stats_spinlock);
+		ct_readaheads += n-1;
+		spinlock_release(&stats_spinlock);
+	}
+
+	lpage_lock(lp);
+	KASSERT(LP_ISBUSY(lp));
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
+	lp->lp_paddr = pas[0]; // page is clean and no longer busy
+	wchan_wakeall(lpage_busychan);
+
+	*paret = pas[0];
+	return 0;
+}
+
+/*
+ * lpage_materialize: create a new lpage and allocate RAM for it. If
+ * ZERO is set the RAM comes zeroed (often zeroed ahead of time by an
+ * idle CPU); otherwise its contents are whatever was there before.
+ *
+ * No swap page is allocated: the caller's swap reservation passes to
+ * the lpage, and lpage_evict allocates swap the first time the page
+ * is written out. The page is dirty, as it has no copy in swap.
  *
  * Returns the lpage locked and the physical page pinned.
  */
 
 static
 int
-lpage_materialize(struct lpage **lpret, paddr_t *paret)
+lpage_materialize(struct lpage **lpret, paddr_t *paret, bool zero)
 {
 	struct lpage *lp;
 	paddr_t pa;
-	off_t swa;
 
 	lp = lpage_create();
 	if (lp == NULL) {
 		return ENOMEM;
 	}
 
-	swa = swap_alloc();
-	if (swa == INVALID_SWAPADDR) {
-		lpage_destroy(lp);
-		return ENOSPC;
-	}
-	lp->lp_swapaddr = swa;
-
-	pa = coremap_allocuser(lp);
+	pa = zero ? coremap_allocuser_zero(lp) : coremap_allocuser(lp);
 	if (pa == INVALID_PADDR) {
-		/* lpage_destroy will clean up the swap */
-		lpage_destroy(lp);
+		/* not lpage_destroy: the reservation stays the caller's */
+		kmem_cache_free(&lpage_cache, lp);
 		return ENOSPC;
 	}
 
@@ -277,84 +504,171 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 
 /*
  * lpage_copy: create a new lpage and copy data from another lpage.
+ * This is how copy-on-write sharing gets broken, so any TLB mapping
+ * of the old page is dropped as well: the caller is about to replace
+ * its mapping with one of the new page.
  *
  * The synchronization for this is kind of unpleasant. We do it like
  * this:
  *
- *      1. Create newlp.
- *      2. Materialize a page for newlp, so it's locked and pinned.
- *      3. Lock and pin oldlp.
- *      4. Extract the physical address and swap address.
- *      5. If oldlp wasn't present,
- *      5a.    Unlock oldlp.
- *      5b.    Page in.
- *      5c.    This pins the page in the coremap.
- *      5d.    Leave the page pinned and relock oldlp.
- *      5e.    Assert nobody else paged the page in.
+ *      1. Lock and pin oldlp.
+ *      2. Extract the physical address and swap address.
+ *      3. If oldlp wasn't present,
+ *      3a.    If another sharer is paging it in, wait and start over.
+ *      3b.    Otherwise page in (lpage_pagein), which leaves the
+ *             page pinned and oldlp locked.
+ *      4. Unlock oldlp, leaving it pinned, so we can enter the coremap.
+ *      5. Materialize a page for newlp, so it's locked and pinned.
  *      6. Copy.
- *      7. Unlock the lpages first, so we can enter the coremap.
- *      8. Unpin the physical pages.
- *      
+ *      7. Unlock newlp and unpin the physical pages.
+ *
+ * Because oldlp stays pinned, nobody can evict it or map it writable
+ * while we copy it.
  */
 int
 lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 {
 	struct lpage *newlp;
 	paddr_t newpa, oldpa;
-	off_t swa;
 	int result;
 
-	result = lpage_materialize(&newlp, &newpa);
-	if (result) {
-		return result;
-	}
-	KASSERT(coremap_pageispinned(newpa));
-
+ retry:
 	/* Pin the physical page and lock the lpage. */
 	lpage_lock_and_pin(oldlp);
 	oldpa = oldlp->lp_paddr & PAGE_FRAME;
 
 	/*
-	 * If there is no physical page, we allocate one, which pins
-	 * it, and then (re)lock the lpage. Since we are single-
-	 * threaded (if we weren't, we'd hold the address space lock
-	 * to exclude sibling threads) nobody else should have paged
-	 * the page in behind our back.
+	 * If there is no physical page, page it in, which leaves it
+	 * pinned and the lpage locked. If another sharer of the page
+	 * is already doing that, wait for them and start over.
 	 */
 	if (oldpa == INVALID_PADDR) {
-		/*
-		 * XXX this is mostly copied from lpage_fault
-		 */
-		swa = oldlp->lp_swapaddr;
-		lpage_unlock(oldlp);
-		oldpa = coremap_allocuser(oldlp);
-		if (oldpa == INVALID_PADDR) {
-			coremap_unpin(newlp->lp_paddr & PAGE_FRAME);
-			lpage_destroy(newlp);
-			return ENOMEM;
+		if (LP_ISBUSY(oldlp)) {
+			lpage_waitbusy(oldlp);
+			goto retry;
+		}
+		result = lpage_pagein(oldlp, NULL, 0, &oldpa);
+		if (result) {
+			return result;
 		}
-		KASSERT(coremap_pageispinned(oldpa));
-		lock_acquire(global_paging_lock);
-		swap_pagein(oldpa, swa);
-		lpage_lock(oldlp);
-		lock_release(global_paging_lock);
-		/* Assert nobody else did the pagein. */
-		KASSERT((oldlp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-		oldlp->lp_paddr = oldpa;
 	}
 
 	KASSERT(coremap_pageispinned(oldpa));
+	lpage_unlock(oldlp);
+
+	result = lpage_materialize(&newlp, &newpa, false);
+	if (result) {
+		coremap_unpin(oldpa);
+		return result;
+	}
+	KASSERT(coremap_pageispinned(newpa));
 
 	coremap_copy_page(oldpa, newpa);
 
 	KASSERT(LP_ISDIRTY(newlp));
 
-	lpage_unlock(oldlp);
 	lpage_unlock(newlp);
 
+	mmu_unmap_paddr(oldpa);
+
 	coremap_unpin(newpa);
 	coremap_unpin(oldpa);
 
+	spinlock_acquire(&stats_spinlock);
+	ct_cowcopies++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = newlp;
+	return 0;
+}
+
+/*
+ * lpage_share: add a reference to an lpage, as at fork time. From now
+ * on the page must only be mapped read-only, so if it's resident throw
+ * away any existing mapping (which might well be writable).
+ *
+ * Synchronization: lock and pin, so the page can't be paged in or out
+ * while we look at it.
+ */
+void
+lpage_share(struct lpage *lp)
+{
+	paddr_t pa;
+
+	lpage_lock_and_pin(lp);
+	lp->lp_refcount++;
+	lp->lp_obj = NULL;
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
+
+	if (pa != INVALID_PADDR) {
+		mmu_unmap_paddr(pa);
+		coremap_unpin(pa);
+	}
+}
+
+/*
+ * lpage_setowner: note that LP is in slot INDEX of VMO, for clustering
+ * pageouts. Does nothing if the page is shared.
+ *
+ * Synchronization: the lpage lock.
+ */
+void
+lpage_setowner(struct lpage *lp, struct vm_object *vmo, unsigned index)
+{
+	lpage_lock(lp);
+	if (lp->lp_refcount == 1) {
+		lp->lp_obj = vmo;
+		lp->lp_objindex = index;
+	}
+	lpage_unlock(lp);
+}
+
+/*
+ * lpage_unshare: prepare an lpage for writing through one of its
+ * references. If the lpage is shared, returns a fresh private copy in
+ * LPRET and drops the caller's reference to the original; otherwise
+ * returns the lpage itself.
+ *
+ * The copy needs a swap reservation of its own. In effect it takes
+ * over the one the lpage holds for this sharer, which lpage_destroy
+ * then gives back; we reserve anew here rather than trying to claim
+ * that one, because two sharers may decide to copy at the same time.
+ *
+ * Synchronization: the refcount is checked under the lpage lock. It
+ * can't go up behind our back, since only fork of the (single-threaded)
+ * owning process adds references.
+ */
+int
+lpage_unshare(struct lpage *lp, struct lpage **lpret)
+{
+	struct lpage *newlp;
+	unsigned refcount;
+	int result;
+
+	lpage_lock(lp);
+	refcount = lp->lp_refcount;
+	lpage_unlock(lp);
+
+	if (refcount == 1) {
+		*lpret = lp;
+		return 0;
+	}
+
+	result = swap_reserve(1);
+	if (result) {
+		return result;
+	}
+
+	result = lpage_copy(lp, &newlp);
+	if (result) {
+		swap_unreserve(1);
+		return result;
+	}
+
+	/* gives back this sharer's reservation on the original */
+	lpage_destroy(lp);
+
 	*lpret = newlp;
 	return 0;
 }
@@ -366,9 +680,8 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
  * nothing prevents the page from being evicted before it is used by
  * the caller.
  *
- * Synchronization: coremap_allocuser returns the new physical page
- * "pinned" (locked) - we hold that lock while we update the page
- * contents and the necessary lpage fields. Unlock the lpage before
+ * Synchronization: coremap_allocuser_zero returns the new physical
+ * page "pinned" (locked), and already zeroed. Unlock the lpage before
  * unpinning, so it's safe to take the coremap spinlock.
  */
 int
@@ -378,7 +691,7 @@ lpage_zerofill(struct lpage **lpret)
 	paddr_t pa;
 	int result;
 
-	result = lpage_materialize(&lp, &pa);
+	result = lpage_materialize(&lp, &pa, true);
 	if (result) {
 		return result;
 	}
@@ -388,8 +701,6 @@ lpage_zerofill(struct lpage **lpret)
 	/* Don't actually need the lpage locked. */
 	lpage_unlock(lp);
 
-	coremap_zero_page(pa);
-
 	KASSERT(coremap_pageispinned(pa));
 	coremap_unpin(pa);
 
@@ -401,18 +712,136 @@ lpage_zerofill(struct lpage **lpret)
 	return 0;
 }
 
+/*
+ * lpage_filefill: create a new lpage and fill it from a file. LEN
+ * bytes at file offset OFFSET are read into the page starting at byte
+ * PAGEOFF; the rest of the page is zeroed. As with lpage_zerofill the
+ * page is resident on return, but needn't stay that way.
+ *
+ * As with lpage_materialize no swap page is allocated, and the page
+ * is dirty. On failure the caller's swap reservation is left alone.
+ *
+ * Synchronization: the physical page comes back from the coremap
+ * pinned, and stays that way during the read, so it can't be evicted.
+ * Nobody else can see the lpage until we return it.
+ */
+int
+lpage_filefill(struct vnode *v, off_t offset, size_t len, size_t pageoff,
+	       struct lpage **lpret)
+{
+	struct lpage *lp;
+	paddr_t pa;
+	vaddr_t va;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(pageoff + len <= PAGE_SIZE);
+
+	lp = lpage_create();
+	if (lp == NULL) {
+		return ENOMEM;
+	}
+
+	pa = coremap_allocuser(lp);
+	if (pa == INVALID_PADDR) {
+		kmem_cache_free(&lpage_cache, lp);
+		return ENOSPC;
+	}
+	KASSERT(coremap_pageispinned(pa));
+
+	coremap_zero_page(pa);
+
+	va = coremap_map_swap_page(pa);
+	uio_kinit(&iov, &ku, (char *)va + pageoff, len, offset, UIO_READ);
+	result = VOP_READ(v, &ku);
+	coremap_unmap_swap_page(va, pa);
+	if (result == 0 && ku.uio_resid != 0) {
+		kprintf("vm: short read on file page - file truncated?\n");
+		result = EIO;
+	}
+	if (result) {
+		coremap_free(pa, false /* iskern */);
+		coremap_unpin(pa);
+		kmem_cache_free(&lpage_cache, lp);
+		return result;
+	}
+
+	lpage_lock(lp);
+	lp->lp_paddr = pa | LPF_DIRTY;
+	lpage_unlock(lp);
+
+	coremap_unpin(pa);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_filefills++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * lpage_writefile: write LEN bytes of an lpage, starting at byte
+ * PAGEOFF, to file offset OFFSET of the file V. This is how changes
+ * to shared file mappings get back to the file. The page is paged in
+ * first if it isn't resident.
+ *
+ * Synchronization: lock and pin the page to find or page in its
+ * frame, then unlock it but keep it pinned for the write, so it can't
+ * be evicted or change frames while we're reading from it.
+ */
+int
+lpage_writefile(struct lpage *lp, struct vnode *v, off_t offset, size_t len,
+		size_t pageoff)
+{
+	paddr_t pa;
+	vaddr_t va;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(pageoff + len <= PAGE_SIZE);
+
+ retry:
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (pa == INVALID_PADDR) {
+		if (LP_ISBUSY(lp)) {
+			lpage_waitbusy(lp);
+			goto retry;
+		}
+		result = lpage_pagein(lp, NULL, 0, &pa);
+		if (result) {
+			return result;
+		}
+	}
+	KASSERT(coremap_pageispinned(pa));
+	lpage_unlock(lp);
+
+	va = coremap_map_swap_page(pa);
+	uio_kinit(&iov, &ku, (char *)va + pageoff, len, offset, UIO_WRITE);
+	vm_text_invalidate(v);
+	result = VOP_WRITE(v, &ku);
+	coremap_unmap_swap_page(va, pa);
+	coremap_unpin(pa);
+
+	return result;
+}
+
 /*
  * lpage_fault - handle a fault on a specific lpage. If the page is
  * not resident, get a physical page from coremap and swap it in.
  * 
- * You do not yet need to distinguish a readonly fault from a write
- * fault. When we implement sharing, there will be a difference.
+ * Write faults on shared (copy-on-write) pages must already have
+ * been dealt with by the caller using lpage_unshare.
  *
  * Synchronization: Lock the lpage while checking if it's in memory. 
- * If it's not, unlock the page while allocating space and loading the
- * page in. This only works because lpages are not currently sharable.
- * The page should be locked again as soon as it is loaded, but be 
- * careful of interactions with other locks while modifying the coremap.
+ * If it's not, mark it busy and unlock it while allocating space and
+ * loading the page in (see lpage_pagein). Another process sharing the
+ * lpage that faults on it meanwhile waits for the busy flag to clear
+ * and starts over. Faults on different pages don't wait for each
+ * other, apart from brief coremap and lpage spinlock holds.
  *
  * After it has been loaded, the page must be pinned so that it is not
  * evicted while changes are made to the TLB. It can be unpinned as soon
@@ -423,18 +852,21 @@ lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 {
 	KASSERT(lp != NULL); // kernel pages never get paged out, thus never fault
 
-	lock_acquire(global_paging_lock);
-	if ((lp->lp_paddr & PAGE_FRAME) != INVALID_PADDR) {
-		lpage_lock_and_pin(lp);
-	} else {
-		lpage_lock(lp);
-	}
-	lock_release(global_paging_lock);
+ retry:
+	lpage_lock_and_pin(lp);
 
-	KASSERT(lp->lp_swapaddr != INVALID_SWAPADDR);
+	if (LP_ISBUSY(lp)) {
+		/* someone else is paging it in; wait for them */
+		lpage_waitbusy(lp);
+		goto retry;
+	}
 
 	paddr_t pa = lp->lp_paddr;
 	int writable; // 0 if page is read-only, 1 if page is writable
+	int result;
+
+	/* a shared page must never be mapped writable */
+	KASSERT(lp->lp_refcount == 1 || faulttype == VM_FAULT_READ);
 
     /* case 1 - minor fault: the frame is still in memory */
 	if ((pa & PAGE_FRAME) != INVALID_PADDR) {
@@ -457,26 +889,12 @@ lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 		/* make sure it is a major fault */
 		KASSERT(pa == INVALID_PADDR);
 
-		/* allocate a new frame */
-		lpage_unlock(lp); // must not hold lpage locks before entering coremap
-		pa = coremap_allocuser(lp); // do evict if needed, also pin coremap
-		if ((pa & PAGE_FRAME)== INVALID_PADDR) {
+		/* allocate a new frame and read the page from disk */
+		result = lpage_pagein(lp, as, va, &pa);
+		if (result) {
 			DEBUG(DB_VM, "lpage_fault: ENOMEM: va=0x%x\n", va);
-			return ENOMEM;
+			return result;
 		}
-		KASSERT(coremap_pageispinned(pa));
-
-		/* retrieving the content from disk */
-		lock_acquire(global_paging_lock); // because swap_pagein needs it
-		swap_pagein((pa & PAGE_FRAME), lp->lp_swapaddr); // coremap is already pinned above
-		lpage_lock(lp);
-		lock_release(global_paging_lock);
-
-		/* assert that nobody else did the pagein */
-		KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-
-		/* now update PTE with new PFN */
-		lp->lp_paddr = pa ; // page is clean
 
 		/* Setting the TLB entry's dirty bit */
 		writable = 0; // this way we can detect the first write to a page
@@ -495,52 +913,173 @@ lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 	/* PTE entry is dirty if the instruction is a write */
 	if (writable) {
 		LP_SET(lp, LPF_DIRTY);
+		lp->lp_modified = true;
 	}
 
-	/* Put the new TLB entry into the TLB */
-	KASSERT(coremap_pageispinned(lp->lp_paddr)); // done in both cases of above IF clause
-	mmu_map(as, va, lp->lp_paddr, writable); // update TLB and unpin coremap
+	/*
+	 * Put the new TLB entry into the TLB. mmu_map may have to wait
+	 * for another CPU to drop its mapping of a shared page, so let
+	 * go of the lpage first; the physical page stays pinned.
+	 */
+	pa = lp->lp_paddr & PAGE_FRAME;
 	lpage_unlock(lp);
+	KASSERT(coremap_pageispinned(pa)); // done in both cases of above IF clause
+	mmu_map(as, va, pa, writable); // update TLB and unpin coremap
 
 	return 0;
 }
 
 /*
- * lpage_evict: Evict an lpage from physical memory.
+ * lpage_gather: collect the dirty neighbours of a page that's about to
+ * be written out, so they can go in the same I/O. LP, in slot INDEX of
+ * OBJ, is going to swap address SWA, or to newly allocated swap if
+ * that's INVALID_SWAPADDR. We take the pages after it in OBJ that are
+ * resident, dirty, unshared, and either have no swap yet (if LP has
+ * none) or have the swap pages following SWA. They're pinned, and put
+ * in LPS and PAS after LP; returns the total number of pages.
+ *
+ * Synchronization: OBJ can't go away, because destroying it means
+ * destroying LP, which we have pinned. While we hold OBJ's vmo_lock
+ * its other lpages can't go away either. We only try for it and the
+ * pins, though, without waiting: the owner may hold the lock while
+ * waiting to destroy LP, and other evictions hold pages pinned.
+ */
+static
+unsigned
+lpage_gather(struct vm_object *obj, unsigned index, off_t swa,
+	     struct lpage **lps, paddr_t *pas)
+{
+	struct lpage *nb;
+	paddr_t pa;
+	unsigned n;
+	bool ok;
+
+	if (!lock_tryacquire(obj->vmo_lock)) {
+		return 1;
+	}
+
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		if (index + n >= lpage_array_num(obj->vmo_lpages)) {
+			break;
+		}
+		nb = lpage_array_get(obj->vmo_lpages, index + n);
+		if (nb == NULL) {
+			break;
+		}
+
+		lpage_lock(nb);
+		pa = nb->lp_paddr & PAGE_FRAME;
+		lpage_unlock(nb);
+		if (pa == INVALID_PADDR || !coremap_trypin(pa)) {
+			break;
+		}
+
+		lpage_lock(nb);
+		ok = (nb->lp_paddr & PAGE_FRAME) == pa && LP_ISDIRTY(nb) &&
+			nb->lp_refcount == 1 && nb->lp_obj == obj &&
+			nb->lp_objindex == index + n &&
+			nb->lp_swapaddr == (swa == INVALID_SWAPADDR ?
+					    INVALID_SWAPADDR :
+					    swa + n*PAGE_SIZE);
+		lpage_unlock(nb);
+		if (!ok) {
+			coremap_unpin(pa);
+			break;
+		}
+
+		lps[n] = nb;
+		pas[n] = pa;
+	}
+
+	lock_release(obj->vmo_lock);
+	return n;
+}
+
+/*
+ * lpage_evict: Evict an lpage from physical memory. A dirty page
+ * that has never been written out gets its swap page here.
+ *
+ * Dirty pages following it in its vm_object are written out in the
+ * same I/O, to the following swap pages (see lpage_gather); they stay
+ * resident but are clean afterwards, so evicting them later is cheap.
+ * Their mappings are dropped first, so a later write faults and marks
+ * them dirty again.
  *
  * Synchronization: lock the lpage while evicting it. We come here
  * from the coremap and should
  * have pinned the physical page. This is why we must not hold lpage
- * locks while entering the coremap code.
+ * locks while entering the coremap code. The neighbours are pinned
+ * for the duration of the I/O too.
  */
 void
 lpage_evict(struct lpage *lp)
 {
+	struct lpage *lps[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	struct vm_object *obj;
+	unsigned index, i, n, got;
+	off_t swa;
+
 	KASSERT(lp != NULL);
 	lpage_lock(lp);
 
 	KASSERT(lp->lp_paddr != INVALID_PADDR);
-	KASSERT(lp->lp_swapaddr != INVALID_SWAPADDR);
 
 	/* if the page is dirty, swap_pageout */
 	if (LP_ISDIRTY(lp)) {
+		swa = lp->lp_swapaddr;
+		obj = lp->lp_refcount == 1 ? lp->lp_obj : NULL;
+		index = lp->lp_objindex;
         lpage_unlock(lp); // release lock before doing I/O
 
-		KASSERT(lock_do_i_hold(global_paging_lock));
 		KASSERT(coremap_pageispinned(lp->lp_paddr));
 
-        swap_pageout((lp->lp_paddr & PAGE_FRAME), lp->lp_swapaddr);
+		lps[0] = lp;
+		pas[0] = lp->lp_paddr & PAGE_FRAME;
+		n = 1;
+		if (obj != NULL) {
+			n = lpage_gather(obj, index, swa, lps, pas);
+		}
+
+		if (swa == INVALID_SWAPADDR) {
+			/* first trip out; uses the pages' reservations */
+			swa = swap_alloc_run(n, &got);
+			/* if we didn't get enough in a row, leave the rest */
+			for (i=got; i<n; i++) {
+				coremap_unpin(pas[i]);
+			}
+			n = got;
+		}
+
+		for (i=1; i<n; i++) {
+			mmu_unmap_paddr(pas[i]);
+			lpage_lock(lps[i]);
+			LP_CLEAR(lps[i], LPF_DIRTY);
+			lps[i]->lp_swapaddr = swa + i*PAGE_SIZE;
+			lpage_unlock(lps[i]);
+		}
+
+        swap_pageout(pas, n, swa);
+
+		for (i=1; i<n; i++) {
+			coremap_unpin(pas[i]);
+		}
+
         lpage_lock(lp);
         KASSERT((lp->lp_paddr & PAGE_FRAME) != INVALID_PADDR);
+		lp->lp_swapaddr = swa;
 
 		/* update stats */
 		spinlock_acquire(&stats_spinlock);
 		ct_write_evictions++;
+		ct_cluster_cleans += n-1;
 	    DEBUG (DB_VM, "lpage_evict: evicting Dirty page 0x%x\n",
 	    		(lp->lp_paddr & PAGE_FRAME));
 		spinlock_release(&stats_spinlock);
 
 	} else {
+		/* clean pages have been through swap before */
+		KASSERT(lp->lp_swapaddr != INVALID_SWAPADDR);
 
 		/* if page is clean, just update stats */
 		spinlock_acquire(&stats_spinlock);
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <vmprivate.h>
+
+/*
+ * Per-address-space page table.
+ *
+ * This is a two-level table of lpage pointers indexed by virtual
+ * page number. It is a cache of the lpage arrays in the address
+ * space's vm_objects, kept so that a fault on a page that already
+ * exists doesn't have to search the vm_objects. Entries are filled in
+ * by as_fault and cleared by vm_object_setsize; an entry is either
+ * NULL or the same lpage the owning vm_object has for that address.
+ *
+ * Because it's only a cache, failing to allocate a second-level table
+ * isn't an error; the entry just doesn't get cached.
+ *
+ * Synchronization: none. Like the rest of the address space, the page
+ * table belongs to one thread.
+ */
+
+#define PT_L2BITS	10
+#define PT_L2SIZE	(1 << PT_L2BITS)
+#define PT_L1SIZE	(USERSPACETOP / (PAGE_SIZE * PT_L2SIZE))
+
+#define PT_L1INDEX(va)	((va) / (PAGE_SIZE * PT_L2SIZE))
+#define PT_L2INDEX(va)	(((va) / PAGE_SIZE) & (PT_L2SIZE - 1))
+
+struct pagetable {
+	struct lpage **pt_l1[PT_L1SIZE];
+};
+
+/*
+ * pagetable_create: make an empty page table.
+ */
+struct pagetable *
+pagetable_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1SIZE; i++) {
+		pt->pt_l1[i] = NULL;
+	}
+	return pt;
+}
+
+/*
+ * pagetable_destroy: free a page table. The lpages it points to
+ * belong to the vm_objects and are not touched.
+ */
+void
+pagetable_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_L1SIZE; i++) {
+		if (pt->pt_l1[i] != NULL) {
+			kfree(pt->pt_l1[i]);
+		}
+	}
+	kfree(pt);
+}
+
+/*
+ * pagetable_lookup: return the lpage cached for VA, or NULL.
+ */
+struct lpage *
+pagetable_lookup(struct pagetable *pt, vaddr_t va)
+{
+	struct lpage **l2;
+
+	if (va >= USERSPACETOP) {
+		return NULL;
+	}
+	l2 = pt->pt_l1[PT_L1INDEX(va)];
+	if (l2 == NULL) {
+		return NULL;
+	}
+	return l2[PT_L2INDEX(va)];
+}
+
+/*
+ * pagetable_set: cache LP as the lpage for VA. LP may be NULL to
+ * drop the entry.
+ */
+void
+pagetable_set(struct pagetable *pt, vaddr_t va, struct lpage *lp)
+{
+	struct lpage **l2;
+	unsigned i;
+
+	KASSERT(va < USERSPACETOP);
+
+	l2 = pt->pt_l1[PT_L1INDEX(va)];
+	if (l2 == NULL) {
+		if (lp == NULL) {
+			return;
+		}
+		l2 = kmalloc(PT_L2SIZE * sizeof(struct lpage *));
+		if (l2 == NULL) {
+			/* just don't cache it */
+			return;
+		}
+		for (i=0; i<PT_L2SIZE; i++) {
+			l2[i] = NULL;
+		}
+		pt->pt_l1[PT_L1INDEX(va)] = l2;
+	}
+	l2[PT_L2INDEX(va)] = lp;
+}
@@ -37,13 +37,13 @@
 #include <synch.h>
 #include <thread.h>
 #include <current.h>
-#include <mainbus.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
 #include <machine/coremap.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <device.h>
 
 /*
  * swap.c - swapfile management and operations.
@@ -58,30 +58,56 @@ static struct bitmap *swapmap;	// swap allocation map
 static struct lock *swaplock;	// synchronizes swapmap and counters
 
 /*
- * A "reserved" page is one for which no swap page has actually
- * been allocated but for which we are committed to being able to
- * provide swap. This happens when zero-fill pages are allocated.
+ * Swap is committed when a page of virtual memory is created (see
+ * swap_reserve) but a swap page is only allocated when the page is
+ * first written out by lpage_evict. swap_reserved_pages counts the
+ * commitments; it may not exceed swap_commit_limit, which guarantees
+ * that eviction can always find a swap page to write to.
  */
 static unsigned long swap_total_pages;
 static unsigned long swap_free_pages;
 static unsigned long swap_reserved_pages;
-
-static struct vnode *swapstore;	// swap file
+static unsigned long swap_commit_limit;
 
 /*
- * Only one page can be in transit to/from disk at once (at least under
- * present circumstances.) While the disk device will queue up multiple
- * concurrent requests correctly, there's no benefit to doing so. So we
- * enforce mutual exclusion at a higher level. This reduces the number
- * of pages marked in transit at any one time and thus (hopefully) makes
- * paging more intelligent and multipage allocation less likely to starve.
- *
- * This lock signals "intent to page" and should be construed as
- * advisory.
+ * Free-extent cache for swap_alloc. Rather than scan the bitmap from
+ * the start for every page, we collect up to SWAP_NEXTENTS runs of
+ * free pages in one pass, starting where the last pass stopped, and
+ * hand them out in order. Pages in cached extents are still clear in
+ * the bitmap, which remains authoritative. The cache is only refilled
+ * once it's empty, so a run can't be cached twice; a page freed next
+ * to a cached extent is added onto it, others wait for the next scan.
  */
+#define SWAP_NEXTENTS	16
 
-struct lock *global_paging_lock;
+struct swap_extent {
+	unsigned se_start;
+	unsigned se_len;
+};
 
+static struct swap_extent swap_extents[SWAP_NEXTENTS];
+static unsigned swap_curextent;	// first extent with pages left
+static unsigned swap_nextents;	// number of extents found by last scan
+static unsigned swap_scanpos;	// where the next scan starts
+
+/* stats */
+static uint32_t ct_swapallocs;
+static uint32_t ct_swapscans;
+static uint32_t ct_swapreads;
+static uint32_t ct_swapwrites;
+
+static struct vnode *swapstore;	// swap file
+
+/*
+ * If the swapfile is a raw disk (as it normally is), we keep the
+ * device and do I/O straight through its d_io function instead of
+ * through the vnode, so paging doesn't go through the VFS layer at
+ * all. For lhd the transfer goes directly to the driver's request
+ * queue (see lhd_io). swapdev_sectors is the size of a swap page in
+ * device blocks, to check alignment against.
+ */
+static struct device *swapdev;
+static unsigned swapdev_sectors;
 
 /*
  * swap_bootstrap: Initializes swap information and finishes
@@ -95,10 +121,6 @@ swap_bootstrap(void)
 	int rv;
 	struct stat st;
 	char path[sizeof(swapfilename)];
-	off_t minsize;
-	size_t pmemsize;
-
-	pmemsize = mainbus_ramsize();
 
 	strcpy(path, swapfilename);
 	rv = vfs_open(path, O_RDWR, 0, &swapstore);
@@ -109,27 +131,24 @@ swap_bootstrap(void)
 		panic("swap: Unable to continue.\n");
 	}
 
-	minsize = pmemsize*20;
-
 	VOP_STAT(swapstore, &st);
-	if (st.st_size < minsize) {
-		kprintf("swap: swapfile %s is only %lu bytes.\n", swapfilename,
-			(unsigned long) st.st_size);
-		kprintf("swap: with %lu bytes of physical memory it should "
-			"be at least\n", (unsigned long) pmemsize);
-		kprintf("      %lu bytes (%lu blocks), perhaps larger.\n", 
-			(unsigned long) minsize, 
-			(unsigned long) minsize / 512);
-		kprintf("swap: Because we conservatively reserve swap, a "
-			"large amount may be\n");
-		kprintf("      needed to run large workloads.\n");
-		kprintf("swap: Please extend it.\n");
-		panic("swap: Unable to continue.\n");
+	if (st.st_size < 2*PAGE_SIZE) {
+		panic("swap: swapfile %s is only %lu bytes.\n", swapfilename,
+		      (unsigned long) st.st_size);
+	}
+
+	swapdev = dev_fromvnode(swapstore);
+	if (swapdev != NULL) {
+		KASSERT(swapdev->d_blocksize > 0);
+		KASSERT(PAGE_SIZE % swapdev->d_blocksize == 0);
+		swapdev_sectors = PAGE_SIZE / swapdev->d_blocksize;
 	}
 
-	kprintf("swap: swapping to %s (%lu bytes; %lu pages)\n", swapfilename,
+	kprintf("swap: swapping to %s (%lu bytes; %lu pages)%s\n",
+		swapfilename,
 		(unsigned long) st.st_size, 
-		(unsigned long) st.st_size / PAGE_SIZE);
+		(unsigned long) st.st_size / PAGE_SIZE,
+		swapdev != NULL ? " raw" : "");
 
 	swap_total_pages = st.st_size / PAGE_SIZE;
 	swap_free_pages = swap_total_pages;
@@ -150,6 +169,13 @@ swap_bootstrap(void)
 	/* mark the first page of swap used so we can check for errors */
 	bitmap_mark(swapmap, 0);
 	swap_free_pages--;
+	swap_commit_limit = swap_free_pages;
+
+	swap_curextent = swap_nextents = 0;
+	swap_scanpos = 0;
+
+	/* now there's somewhere to page out to */
+	coremap_pageout_bootstrap();
 }
 
 /*
@@ -160,51 +186,183 @@ swap_bootstrap(void)
 void
 swap_shutdown(void)
 {
+	swapdev = NULL;
 	lock_destroy(swaplock);
 	bitmap_destroy(swapmap);
 	vfs_close(swapstore);
 }
 
 /*
- * swap_alloc: allocates a page in the swapfile.
- * The page should have already been reserved with swap_reserve.
+ * swap_addextent: add a run of free pages to the extent cache.
+ * Returns true if the cache is now full.
+ */
+static
+bool
+swap_addextent(unsigned start, unsigned len)
+{
+	KASSERT(swap_nextents < SWAP_NEXTENTS);
+	swap_extents[swap_nextents].se_start = start;
+	swap_extents[swap_nextents].se_len = len;
+	swap_nextents++;
+	return swap_nextents == SWAP_NEXTENTS;
+}
+
+/*
+ * swap_findextents: refill the (empty) extent cache by scanning the
+ * bitmap from swap_scanpos, wrapping around at the end, until the
+ * cache is full or the whole map has been looked at. Bytes with all
+ * pages in use are skipped whole.
+ *
+ * Synchronization: call with swaplock held.
+ */
+static
+void
+swap_findextents(void)
+{
+	const uint8_t *map;
+	unsigned pos, scanned, runlen;
+
+	KASSERT(lock_do_i_hold(swaplock));
+	map = bitmap_getdata(swapmap);
+	swap_curextent = swap_nextents = 0;
+	ct_swapscans++;
+
+	pos = swap_scanpos;
+	runlen = 0;
+	scanned = 0;
+	while (scanned < swap_total_pages) {
+		if (runlen == 0 && pos % 8 == 0 && map[pos / 8] == 0xff &&
+		    pos + 8 <= swap_total_pages) {
+			pos += 8;
+			scanned += 8;
+		}
+		else if (map[pos / 8] & (1 << (pos % 8))) {
+			if (runlen > 0) {
+				if (swap_addextent(pos - runlen, runlen)) {
+					runlen = 0;
+					break;
+				}
+				runlen = 0;
+			}
+			pos++;
+			scanned++;
+		}
+		else {
+			runlen++;
+			pos++;
+			scanned++;
+		}
+
+		if (pos == swap_total_pages) {
+			/* runs don't wrap around the end */
+			if (runlen > 0 && swap_addextent(pos - runlen, runlen)) {
+				runlen = 0;
+				pos = 0;
+				break;
+			}
+			runlen = 0;
+			pos = 0;
+		}
+	}
+	if (runlen > 0) {
+		swap_addextent(pos - runlen, runlen);
+	}
+	swap_scanpos = pos;
+}
+
+/*
+ * swap_alloc_run: allocates up to MAXPAGES contiguous pages in the
+ * swapfile, and at least one; returns the address of the first and
+ * the number allocated in NPAGES. This is done when pages are first
+ * written out, and draws on the swap committed for them with
+ * swap_reserve.
+ *
+ * We take the first cached extent that's long enough, or failing
+ * that the longest one. Extents left empty are skipped over later.
  *
  * Synchronization: uses swaplock.
  */
 off_t
-swap_alloc(void)
+swap_alloc_run(unsigned maxpages, unsigned *npages)
 {
-	uint32_t rv, index;
+	struct swap_extent *se;
+	uint32_t index;
+	unsigned i, n;
 	
+	KASSERT(maxpages > 0);
+
 	lock_acquire(swaplock);
 
 	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
+	KASSERT(swap_reserved_pages <= swap_commit_limit);
 
-	KASSERT(swap_reserved_pages>0);
+	/* If this blows up, our counters are wrong */
 	KASSERT(swap_free_pages>0);
 
-	rv = bitmap_alloc(swapmap, &index);
-	/* If this blows up, our counters are wrong */
-	KASSERT(rv == 0);
+	while (swap_curextent < swap_nextents &&
+	       swap_extents[swap_curextent].se_len == 0) {
+		swap_curextent++;
+	}
+	if (swap_curextent == swap_nextents) {
+		swap_findextents();
+	}
+	KASSERT(swap_curextent < swap_nextents);
+
+	se = &swap_extents[swap_curextent];
+	for (i=swap_curextent; i<swap_nextents; i++) {
+		if (swap_extents[i].se_len >= maxpages) {
+			se = &swap_extents[i];
+			break;
+		}
+		if (swap_extents[i].se_len > se->se_len) {
+			se = &swap_extents[i];
+		}
+	}
 
-	swap_reserved_pages--;
-	swap_free_pages--;
+	n = se->se_len < maxpages ? se->se_len : maxpages;
+	KASSERT(n > 0);
+	index = se->se_start;
+	se->se_start += n;
+	se->se_len -= n;
+
+	for (i=0; i<n; i++) {
+		bitmap_mark(swapmap, index + i);
+	}
+	swap_free_pages -= n;
+	ct_swapallocs += n;
+
+	/* Every allocated page belongs to a committed page. */
+	KASSERT(swap_commit_limit - swap_free_pages <= swap_reserved_pages);
 
 	lock_release(swaplock);
 
+	*npages = n;
 	return index*PAGE_SIZE;
 }
 
 /*
- * swap_free: marks a page in the swapfile as unused.
+ * swap_alloc: allocates a single page in the swapfile.
+ */
+off_t
+swap_alloc(void)
+{
+	unsigned n;
+
+	return swap_alloc_run(1, &n);
+}
+
+/*
+ * swap_free: marks a page in the swapfile as unused. If it adjoins
+ * one of the cached free extents, it goes back into the cache.
  *
  * Synchronization: uses swaplock.
  */
 void
 swap_free(off_t swapaddr)
 {
+	struct swap_extent *se;
 	uint32_t index;
+	unsigned i;
 
 	KASSERT(swapaddr != INVALID_SWAPADDR);
 	KASSERT(swapaddr % PAGE_SIZE == 0);
@@ -214,18 +372,31 @@ swap_free(off_t swapaddr)
 	lock_acquire(swaplock);
 
 	KASSERT(swap_free_pages < swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
 
 	KASSERT(bitmap_isset(swapmap, index));
 	bitmap_unmark(swapmap, index);
 	swap_free_pages++;
 
+	for (i=swap_curextent; i<swap_nextents; i++) {
+		se = &swap_extents[i];
+		if (index + 1 == se->se_start) {
+			se->se_start--;
+			se->se_len++;
+			break;
+		}
+		if (index == se->se_start + se->se_len) {
+			se->se_len++;
+			break;
+		}
+	}
+
 	lock_release(swaplock);
 }
 
 /*
- * swap_reserve/unreserve: reserve some pages for future allocation, or
- * release such pages.
+ * swap_reserve/unreserve: commit swap for some pages of virtual
+ * memory, or release such a commitment. The swap page itself isn't
+ * allocated until it's needed, but we promise it will be there.
  *
  * Synchronization: uses swaplock.
  */
@@ -234,19 +405,15 @@ swap_reserve(unsigned long npages)
 {
 	lock_acquire(swaplock);
 
-	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
+	KASSERT(swap_reserved_pages <= swap_commit_limit);
 
-	if (swap_free_pages - swap_reserved_pages < npages) {
+	if (swap_commit_limit - swap_reserved_pages < npages) {
 		lock_release(swaplock);
 		return ENOMEM;
 	}
 
 	swap_reserved_pages += npages;
 
-	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
-
 	lock_release(swaplock);
 	return 0;
 }
@@ -256,48 +423,100 @@ swap_unreserve(unsigned long npages)
 {
 	lock_acquire(swaplock);
 
-	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
+	KASSERT(swap_reserved_pages <= swap_commit_limit);
 
 	KASSERT(npages <= swap_reserved_pages);
 	swap_reserved_pages -= npages;
 
+	KASSERT(swap_commit_limit - swap_free_pages <= swap_reserved_pages);
+
+	lock_release(swaplock);
+}
+
+/*
+ * swap_printstats: print swap usage.
+ *
+ * Synchronization: uses swaplock.
+ */
+void
+swap_printstats(void)
+{
+	unsigned long total, used, committed;
+	uint32_t allocs, scans, reads, writes;
+
+	lock_acquire(swaplock);
+	total = swap_commit_limit;
+	used = swap_commit_limit - swap_free_pages;
+	committed = swap_reserved_pages;
+	allocs = ct_swapallocs;
+	scans = ct_swapscans;
+	reads = ct_swapreads;
+	writes = ct_swapwrites;
 	lock_release(swaplock);
+
+	kprintf("swap: %lu pages, %lu committed, %lu in use\n",
+		total, committed, used);
+	kprintf("swap: %lu allocations, %lu map scans\n",
+		(unsigned long) allocs, (unsigned long) scans);
+	kprintf("swap: %lu reads, %lu writes\n",
+		(unsigned long) reads, (unsigned long) writes);
 }
 
 /*
- * swap_io: Does one swap I/O. Panics on failure.
+ * swap_io: Does one swap I/O, of NPAGES physical pages to or from
+ * consecutive pages of swap starting at SWAPADDR. The pages go in
+ * one call to the swap device's d_io, or failing that one VOP_READ
+ * or VOP_WRITE, one iovec per page. Panics on failure.
  *
- * Synchronization: none specifically. The physical page should be
- * marked "pinned" (locked) so it won't be touched by other people.
+ * Synchronization: none specifically. The physical pages should be
+ * marked "pinned" (locked) so they won't be touched by other people.
+ * Any number of swap I/Os can be in progress at once; the disk driver
+ * queues them.
  */
 static
 void
-swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
+swap_io(const paddr_t *pas, unsigned npages, off_t swapaddr, enum uio_rw rw)
 {
-	struct iovec iov;
+	struct iovec iov[SWAP_CLUSTER];
 	struct uio u;
-	vaddr_t va;
+	unsigned i;
 	int result;
 
-	KASSERT(lock_do_i_hold(global_paging_lock));
-
-	KASSERT(pa != INVALID_PADDR);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
 	KASSERT(swapaddr % PAGE_SIZE == 0);
-	KASSERT(coremap_pageispinned(pa));
-	KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
 
-	va = coremap_map_swap_page(pa);
+	for (i=0; i<npages; i++) {
+		KASSERT(pas[i] != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pas[i]));
+		KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE + i));
 
-	uio_kinit(&iov, &u, (char *)va, PAGE_SIZE, swapaddr, rw);
-	if (rw==UIO_READ) {
+		iov[i].iov_kbase = (void *)coremap_map_swap_page(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = swapaddr;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	if (swapdev != NULL) {
+		KASSERT(swapaddr / swapdev->d_blocksize + npages*swapdev_sectors
+			<= (uint32_t)swapdev->d_blocks);
+		result = swapdev->d_io(swapdev, &u);
+	}
+	else if (rw==UIO_READ) {
 		result = VOP_READ(swapstore, &u);
 	}
 	else {
 		result = VOP_WRITE(swapstore, &u);
 	}
 
-	coremap_unmap_swap_page(va, pa);
+	for (i=0; i<npages; i++) {
+		coremap_unmap_swap_page((vaddr_t)iov[i].iov_kbase, pas[i]);
+	}
 
 	if (result==EIO) {
 		panic("swap: EIO on swapfile (offset %ld)\n",
@@ -311,25 +530,36 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 		panic("swap: Error %d from swapfile (offset %ld)\n",
 		      result, (long)swapaddr);
 	}
+
+	lock_acquire(swaplock);
+	if (rw==UIO_READ) {
+		ct_swapreads++;
+	}
+	else {
+		ct_swapwrites++;
+	}
+	lock_release(swaplock);
 }
 
 /*
- * swap_pagein: load one page from swap into physical memory.
+ * swap_pagein: load NPAGES pages from consecutive swap pages into
+ * physical memory.
  * Synchronization: none here. See swap_io().
  */
 void
-swap_pagein(paddr_t pa, off_t swapaddr)
+swap_pagein(const paddr_t *pas, unsigned npages, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_READ);
+	swap_io(pas, npages, swapaddr, UIO_READ);
 }
 
 
 /* 
- * swap_pageout: write one page from physical memory into swap.
+ * swap_pageout: write NPAGES pages from physical memory into
+ * consecutive swap pages.
  * Synchronization: none here. See swap_io().
  */
 void
-swap_pageout(paddr_t pa, off_t swapaddr)
+swap_pageout(const paddr_t *pas, unsigned npages, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_WRITE);
+	swap_io(pas, npages, swapaddr, UIO_WRITE);
 }
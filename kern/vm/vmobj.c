@@ -31,10 +31,12 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <synch.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
 #include <machine/coremap.h>
+#include <vnode.h>
 
 /*
  * vm_object operations.
@@ -43,6 +45,26 @@
 
 DEFARRAY_BYTYPE(lpage_array, struct lpage, /*noinline*/);
 
+/*
+ * Table of shared text objects, and the lock that protects it and
+ * their reference counts.
+ */
+static struct vm_object_array *vm_texts;
+static struct lock *vm_textlock;
+
+/*
+ * vm_object_bootstrap: set up the text object table.
+ */
+void
+vm_object_bootstrap(void)
+{
+	vm_texts = vm_object_array_create();
+	vm_textlock = lock_create("vm_textlock");
+	if (vm_texts == NULL || vm_textlock == NULL) {
+		panic("vm_object_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * vm_object_create: Allocate a new vm_object with nothing in it.
  * Returns: new vm_object on success, NULL on error.
@@ -75,9 +97,28 @@ vm_object_create(size_t npages)
 	vmo->vmo_base = 0xdeafbeef;		/* make sure these */
 	vmo->vmo_lower_redzone = 0xdeafbeef;	/* get filled in later */
 
+	vmo->vmo_vnode = NULL;
+	vmo->vmo_fileoffset = 0;
+	vmo->vmo_filestart = 0;
+	vmo->vmo_fileend = 0;
+	vmo->vmo_text = NULL;
+	vmo->vmo_refcount = 0;
+	vmo->vmo_ismmap = false;
+	vmo->vmo_writeable = true;
+	vmo->vmo_writeback = false;
+
+	vmo->vmo_lock = lock_create("vmobj");
+	if (vmo->vmo_lock == NULL) {
+		lpage_array_destroy(vmo->vmo_lpages);
+		kfree(vmo);
+		swap_unreserve(npages);
+		return NULL;
+	}
+
 	/* add the requested number of zerofilled pages */
 	result = lpage_array_setsize(vmo->vmo_lpages, npages);
 	if (result) {
+		lock_destroy(vmo->vmo_lock);
 		lpage_array_destroy(vmo->vmo_lpages);
 		kfree(vmo);
 		swap_unreserve(npages);
@@ -94,17 +135,25 @@ vm_object_create(size_t npages)
 /*
  * vm_object_copy: clone a vm_object.
  *
- * Synchronization: None; lpage_copy does the hard stuff.
+ * The lpages are not copied; instead the new object shares them
+ * copy-on-write with the old one, and the first write through either
+ * object makes a private copy (see lpage_unshare). The swap pages the
+ * new object reserves stand in for those copies.
+ *
+ * Because the pages aren't shared for writing, a shared file mapping
+ * can't stay shared in the child. The copy gets vmo_writeback clear,
+ * so it turns into a private mapping of the file as it was at fork
+ * time, and only the parent writes its changes back.
+ *
+ * Synchronization: None; lpage_share does the hard stuff.
  */
 int
-vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
-	       struct vm_object **ret)
+vm_object_copy(struct vm_object *vmo, struct vm_object **ret)
 {
 	struct vm_object *newvmo;
 
 	struct lpage *newlp, *lp;
 	unsigned j;
-	int result;
 
 	newvmo = vm_object_create(lpage_array_num(vmo->vmo_lpages));
 	if (newvmo == NULL) {
@@ -114,6 +163,23 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 	newvmo->vmo_base = vmo->vmo_base;
 	newvmo->vmo_lower_redzone = vmo->vmo_lower_redzone;
 
+	if (vmo->vmo_vnode != NULL) {
+		VOP_INCREF(vmo->vmo_vnode);
+		newvmo->vmo_vnode = vmo->vmo_vnode;
+		newvmo->vmo_fileoffset = vmo->vmo_fileoffset;
+		newvmo->vmo_filestart = vmo->vmo_filestart;
+		newvmo->vmo_fileend = vmo->vmo_fileend;
+	}
+	if (vmo->vmo_text != NULL) {
+		lock_acquire(vm_textlock);
+		vmo->vmo_text->vmo_refcount++;
+		lock_release(vm_textlock);
+		newvmo->vmo_text = vmo->vmo_text;
+	}
+	newvmo->vmo_ismmap = vmo->vmo_ismmap;
+	newvmo->vmo_writeable = vmo->vmo_writeable;
+	newvmo->vmo_writeback = false;
+
 	for (j = 0; j < lpage_array_num(vmo->vmo_lpages); j++) {
 		lp = lpage_array_get(vmo->vmo_lpages, j);
 		newlp = lpage_array_get(newvmo->vmo_lpages, j);
@@ -126,23 +192,21 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 			continue;
 		}
 
-		result = lpage_copy(lp, &newlp);
-		if (result) {
-			goto fail;
-		}
-		lpage_array_set(newvmo->vmo_lpages, j, newlp);
+		lpage_share(lp);
+		lpage_array_set(newvmo->vmo_lpages, j, lp);
 	}
 
 	*ret = newvmo;
 	return 0;
-
- fail:
-	vm_object_destroy(newas, newvmo);
-	return result;
 }
 
 /*
- * vm_object_setsize: change the size of a vm_object.
+ * vm_object_setsize: change the size of a vm_object. AS is the
+ * address space it's mapped in; it may only be NULL for objects that
+ * aren't mapped anywhere (text objects, or ones not yet added to an
+ * address space).
+ *
+ * Synchronization: vmo_lock, against the pageout code.
  */
 int
 vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
@@ -154,13 +218,23 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 	KASSERT(vmo != NULL);
 	KASSERT(vmo->vmo_lpages != NULL);
 
+	lock_acquire(vmo->vmo_lock);
 	if (npages < lpage_array_num(vmo->vmo_lpages)) {
 		for (i=npages; i<lpage_array_num(vmo->vmo_lpages); i++) {
 			lp = lpage_array_get(vmo->vmo_lpages, i);
-			if (lp != NULL) {
-				KASSERT(as != NULL);
-				/* remove any tlb entry for this mapping */
+			if (as != NULL) {
+				/*
+				 * Remove any tlb entry for this mapping;
+				 * even an untouched page may have the zero
+				 * frame mapped.
+				 */
 				mmu_unmap(as, vmo->vmo_base+PAGE_SIZE*i);
+			}
+			if (lp != NULL) {
+				if (as != NULL) {
+					pagetable_set(as->as_pagetable,
+						 vmo->vmo_base+PAGE_SIZE*i, NULL);
+				}
 				lpage_destroy(lp);
 			}
 			else {
@@ -177,11 +251,13 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 
 		result = swap_reserve(newpages);
 		if (result) {
+			lock_release(vmo->vmo_lock);
 			return result;
 		}
 
 		result = lpage_array_setsize(vmo->vmo_lpages, npages);
 		if (result) {
+			lock_release(vmo->vmo_lock);
 			swap_unreserve(newpages);
 			return result;
 		}
@@ -189,9 +265,325 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 			lpage_array_set(vmo->vmo_lpages, i, NULL);
 		}
 	}
+	lock_release(vmo->vmo_lock);
+	return 0;
+}
+
+/*
+ * vm_text_get: find or create the shared text object for a read-only
+ * file-backed segment, and add a reference to it. The segment must
+ * match exactly: same file, file range, and object placement. Only
+ * objects in the table are found; once the file has been changed the
+ * old ones are taken out (see vm_text_invalidate).
+ *
+ * Synchronization: vm_textlock.
+ */
+static
+int
+vm_text_get(struct vnode *v, off_t offset, vaddr_t start, vaddr_t end,
+	    vaddr_t base, unsigned npages, struct vm_object **ret)
+{
+	struct vm_object *text;
+	unsigned i;
+	int result;
+
+	lock_acquire(vm_textlock);
+	for (i=0; i<vm_object_array_num(vm_texts); i++) {
+		text = vm_object_array_get(vm_texts, i);
+		if (text->vmo_vnode == v && text->vmo_fileoffset == offset &&
+		    text->vmo_filestart == start && text->vmo_fileend == end &&
+		    text->vmo_base == base &&
+		    lpage_array_num(text->vmo_lpages) == npages) {
+			text->vmo_refcount++;
+			lock_release(vm_textlock);
+			*ret = text;
+			return 0;
+		}
+	}
+
+	text = vm_object_create(npages);
+	if (text == NULL) {
+		lock_release(vm_textlock);
+		return ENOMEM;
+	}
+	text->vmo_base = base;
+	text->vmo_lower_redzone = 0;
+	VOP_INCREF(v);
+	text->vmo_vnode = v;
+	text->vmo_fileoffset = offset;
+	text->vmo_filestart = start;
+	text->vmo_fileend = end;
+	text->vmo_refcount = 1;
+
+	result = vm_object_array_add(vm_texts, text, NULL);
+	if (result) {
+		lock_release(vm_textlock);
+		vm_object_destroy(NULL, text);
+		return result;
+	}
+	v->vn_ntexts++;
+	lock_release(vm_textlock);
+
+	*ret = text;
+	return 0;
+}
+
+/*
+ * vm_text_remove: take TEXT out of the table, if it's still there.
+ *
+ * Synchronization: caller holds vm_textlock.
+ */
+static
+void
+vm_text_remove(struct vm_object *text)
+{
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(vm_textlock));
+
+	num = vm_object_array_num(vm_texts);
+	for (i=0; i<num; i++) {
+		if (vm_object_array_get(vm_texts, i) == text) {
+			vm_object_array_remove(vm_texts, i);
+			KASSERT(text->vmo_vnode->vn_ntexts > 0);
+			text->vmo_vnode->vn_ntexts--;
+			return;
+		}
+	}
+}
+
+/*
+ * vm_text_release: drop a reference to a text object, destroying it
+ * when the last one goes.
+ *
+ * Synchronization: vm_textlock.
+ */
+static
+void
+vm_text_release(struct vm_object *text)
+{
+	lock_acquire(vm_textlock);
+	KASSERT(text->vmo_refcount > 0);
+	text->vmo_refcount--;
+	if (text->vmo_refcount > 0) {
+		lock_release(vm_textlock);
+		return;
+	}
+	vm_text_remove(text);
+	lock_release(vm_textlock);
+
+	vm_object_destroy(NULL, text);
+}
+
+/*
+ * vm_text_invalidate: the file V is being written or truncated. Take
+ * its text objects out of the table, so later execs and mappings of
+ * the file make new ones from the new contents rather than sharing
+ * pages read from the old. Processes already using the old objects
+ * keep them; the last one to go destroys each.
+ *
+ * Synchronization: vm_textlock. vn_ntexts is peeked at first without
+ * it, so writes to files nobody has exec'd don't take the lock; an
+ * exec racing with the write may share the old pages either way.
+ */
+void
+vm_text_invalidate(struct vnode *v)
+{
+	struct vm_object *text;
+	unsigned i;
+
+	if (v->vn_ntexts == 0) {
+		return;
+	}
+
+	lock_acquire(vm_textlock);
+	i = 0;
+	while (i < vm_object_array_num(vm_texts)) {
+		text = vm_object_array_get(vm_texts, i);
+		if (text->vmo_vnode == v) {
+			vm_text_remove(text);
+		}
+		else {
+			i++;
+		}
+	}
+	KASSERT(v->vn_ntexts == 0);
+	lock_release(vm_textlock);
+}
+
+/*
+ * vm_object_setfile: back VMO with the file V. FILESIZE bytes at
+ * virtual address VADDR come from file offset OFFSET. If SHARED is
+ * set the pages are never going to be written, so they are taken
+ * from (and shared with) the text object for the same segment.
+ *
+ * Synchronization: none; assumes one thread uniquely owns VMO.
+ */
+int
+vm_object_setfile(struct vm_object *vmo, struct vnode *v, off_t offset,
+		  vaddr_t vaddr, size_t filesize, bool shared)
+{
+	unsigned npages;
+	int result;
+
+	npages = lpage_array_num(vmo->vmo_lpages);
+
+	KASSERT(vmo->vmo_vnode == NULL);
+	KASSERT(vaddr >= vmo->vmo_base);
+	KASSERT(vaddr + filesize <= vmo->vmo_base + npages*PAGE_SIZE);
+
+	if (shared) {
+		result = vm_text_get(v, offset, vaddr, vaddr + filesize,
+				     vmo->vmo_base, npages, &vmo->vmo_text);
+		if (result) {
+			return result;
+		}
+	}
+
+	VOP_INCREF(v);
+	vmo->vmo_vnode = v;
+	vmo->vmo_fileoffset = offset;
+	vmo->vmo_filestart = vaddr;
+	vmo->vmo_fileend = vaddr + filesize;
 	return 0;
 }
 
+/*
+ * vm_object_iszero: return true if page INDEX of VMO, which has a NULL
+ * lpage, would be all zeros when materialized: that is, if the object
+ * isn't file-backed or the page lies outside the file part of it.
+ * Read faults on such pages can map the zero frame instead.
+ */
+bool
+vm_object_iszero(const struct vm_object *vmo, unsigned index)
+{
+	vaddr_t va, start, end;
+
+	if (vmo->vmo_vnode == NULL) {
+		return true;
+	}
+	va = vmo->vmo_base + index*PAGE_SIZE;
+	start = va > vmo->vmo_filestart ? va : vmo->vmo_filestart;
+	end = va + PAGE_SIZE < vmo->vmo_fileend ?
+		va + PAGE_SIZE : vmo->vmo_fileend;
+	return start >= end;
+}
+
+/*
+ * vm_object_readpage: materialize page INDEX of a file-backed object,
+ * reading whatever part of it lies in the file and zeroing the rest.
+ */
+static
+int
+vm_object_readpage(struct vm_object *vmo, unsigned index,
+		   struct lpage **lpret)
+{
+	vaddr_t va, start, end;
+
+	if (vm_object_iszero(vmo, index)) {
+		return lpage_zerofill(lpret);
+	}
+
+	va = vmo->vmo_base + index*PAGE_SIZE;
+	start = va > vmo->vmo_filestart ? va : vmo->vmo_filestart;
+	end = va + PAGE_SIZE < vmo->vmo_fileend ?
+		va + PAGE_SIZE : vmo->vmo_fileend;
+	KASSERT(start < end);
+
+	return lpage_filefill(vmo->vmo_vnode,
+			      vmo->vmo_fileoffset + (start - vmo->vmo_filestart),
+			      end - start, start - va, lpret);
+}
+
+/*
+ * vm_object_filefill: materialize page INDEX of a file-backed object,
+ * which has a NULL lpage. If there's a text object, get the page from
+ * there, reading it into the text object if nobody has yet; the page
+ * returned is then shared with the text object.
+ *
+ * Synchronization: the text object's lock is held while we look at or
+ * fill in its page, so the page only gets read once.
+ */
+int
+vm_object_filefill(struct vm_object *vmo, unsigned index,
+		   struct lpage **lpret)
+{
+	struct vm_object *text;
+	struct lpage *lp;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(lpage_array_get(vmo->vmo_lpages, index) == NULL);
+
+	text = vmo->vmo_text;
+	if (text == NULL) {
+		return vm_object_readpage(vmo, index, lpret);
+	}
+
+	lock_acquire(text->vmo_lock);
+	lp = lpage_array_get(text->vmo_lpages, index);
+	if (lp == NULL) {
+		result = vm_object_readpage(text, index, &lp);
+		if (result) {
+			lock_release(text->vmo_lock);
+			return result;
+		}
+		lpage_array_set(text->vmo_lpages, index, lp);
+	}
+	lpage_share(lp);
+	lock_release(text->vmo_lock);
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * vm_object_writeback: write the part of each modified page that lies
+ * in the file back to the file. Pages that were never touched are
+ * still NULL, and ones that were only read are as they came from the
+ * file; writing those back would undo changes other processes have
+ * made to the file since.
+ */
+static
+void
+vm_object_writeback(struct vm_object *vmo)
+{
+	struct lpage *lp;
+	vaddr_t va, start, end;
+	unsigned i;
+	bool modified;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+
+	for (i=0; i<lpage_array_num(vmo->vmo_lpages); i++) {
+		lp = lpage_array_get(vmo->vmo_lpages, i);
+		if (lp == NULL) {
+			continue;
+		}
+		lpage_lock(lp);
+		modified = lp->lp_modified;
+		lpage_unlock(lp);
+		if (!modified) {
+			continue;
+		}
+		va = vmo->vmo_base + i*PAGE_SIZE;
+		start = va > vmo->vmo_filestart ? va : vmo->vmo_filestart;
+		end = va + PAGE_SIZE < vmo->vmo_fileend ?
+			va + PAGE_SIZE : vmo->vmo_fileend;
+		if (start >= end) {
+			continue;
+		}
+		result = lpage_writefile(lp, vmo->vmo_vnode,
+			vmo->vmo_fileoffset + (start - vmo->vmo_filestart),
+			end - start, start - va);
+		if (result) {
+			kprintf("vm: writing back mapped page at 0x%x: %s\n",
+				va, strerror(result));
+		}
+	}
+}
+
 /*
  * vm_object_destroy: Deallocates a vm_object.
  *
@@ -202,8 +594,20 @@ vm_object_destroy(struct addrspace *as, struct vm_object *vmo)
 {
 	int result;
 
+	if (vmo->vmo_writeback) {
+		vm_object_writeback(vmo);
+	}
+
 	result = vm_object_setsize(as, vmo, 0);
 	KASSERT(result==0);
+
+	if (vmo->vmo_text != NULL) {
+		vm_text_release(vmo->vmo_text);
+	}
+	if (vmo->vmo_vnode != NULL) {
+		VOP_DECREF(vmo->vmo_vnode);
+	}
+	lock_destroy(vmo->vmo_lock);
 	
 	lpage_array_destroy(vmo->vmo_lpages);
 	kfree(vmo);
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest.c
+ *
+ * 	Tests mmap and munmap on a small file: that mapped pages match
+ * 	the file, that private mappings leave it alone, and that stores
+ * 	through a shared writeable mapping reach the file at munmap
+ * 	without changing its length.
+ *
+ * Needs a file system that can be written to, and mmap support in
+ * the kernel.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define TESTFILE "mmaptest.file"
+#define PAGESIZE 4096
+#define FILESIZE (3*PAGESIZE + 100)
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(int i)
+{
+	return 'a' + (i * 7) % 26;
+}
+
+static
+void
+makefile(void)
+{
+	int fd, i;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i);
+	}
+
+	fd = open(TESTFILE, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd<0) {
+		err(1, "%s: open for write", TESTFILE);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", TESTFILE);
+	}
+	close(fd);
+}
+
+/*
+ * Read the file back and check it against the pattern, except that
+ * bytes in [changed, changed+len) should be 'X'.
+ */
+static
+void
+checkfile(const char *what, int changed, int len)
+{
+	int fd, i;
+	char want;
+
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd<0) {
+		err(1, "%s: open for read", TESTFILE);
+	}
+	if (read(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: read", TESTFILE);
+	}
+	if (lseek(fd, 0, SEEK_END) != FILESIZE) {
+		errx(1, "%s: file length changed", what);
+	}
+	close(fd);
+
+	for (i=0; i<FILESIZE; i++) {
+		want = (i >= changed && i < changed+len) ? 'X' : pattern(i);
+		if (buf[i] != want) {
+			errx(1, "%s: byte %d is %c, should be %c",
+			     what, i, buf[i], want);
+		}
+	}
+	warnx("passed: %s", what);
+}
+
+static
+char *
+domap(int openflags, int prot, int flags)
+{
+	char *p;
+	int fd;
+
+	fd = open(TESTFILE, openflags);
+	if (fd<0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = mmap(NULL, FILESIZE, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	/* the mapping outlives the descriptor */
+	close(fd);
+	return p;
+}
+
+int
+main(void)
+{
+	char *p;
+	int fd, i;
+
+	makefile();
+
+	/* read-only: the mapped bytes are the file's */
+	p = domap(O_RDONLY, PROT_READ, MAP_PRIVATE);
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i)) {
+			errx(1, "read mapping: byte %d is %c, should be %c",
+			     i, p[i], pattern(i));
+		}
+	}
+	/* the rest of the last page reads as zeros */
+	for (i=FILESIZE; i<4*PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "read mapping: byte %d past EOF is %d",
+			     i, p[i]);
+		}
+	}
+	if (munmap(p, PAGESIZE) == 0) {
+		errx(1, "munmap of part of a mapping succeeded");
+	}
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+	warnx("passed: read mapping");
+
+	/* private stores don't reach the file */
+	p = domap(O_RDWR, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+	memset(p + PAGESIZE, 'X', 10);
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+	checkfile("private mapping", 0, 0);
+
+	/* shared stores do, including into the partial last page */
+	p = domap(O_RDWR, PROT_READ|PROT_WRITE, MAP_SHARED);
+	memset(p + 3*PAGESIZE - 5, 'X', 10);
+	/* past EOF: must not grow the file */
+	memset(p + FILESIZE, 'X', 10);
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+	checkfile("shared mapping", 3*PAGESIZE - 5, 10);
+
+	/* can't write back to a file that isn't open for writing */
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd<0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "shared writeable mapping of read-only file worked");
+	}
+	close(fd);
+
+	remove(TESTFILE);
+	printf("Passed mmaptest.\n");
+	return 0;
+}